@@ -0,0 +1,108 @@
+//
+//  async.h
+//  iff
+//
+//  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
+//
+
+#ifndef iff_async_h
+#define iff_async_h
+
+#include "atomic"
+#include "condition_variable"
+#include "deque"
+#include "future"
+#include "mutex"
+#include "thread"
+#include "unordered_set"
+#include "sys/uio.h"
+#include "iff.h"
+
+namespace IFFSpace
+{
+	//
+	// Asynchronous chunk loader class
+	// Loads chunk data from an IFF without blocking the caller.
+	// Load() queues reads and returns a future which becomes true once
+	// the chunk's data is in memory (decompressed, for compressed chunks).
+	// Submit() starts everything queued as one batch.
+	//
+	// On Linux the reads go through io_uring, keeping up to depth reads
+	// in flight from a single thread. Where io_uring isn't available,
+	// a pool of threads calls pread() instead.
+	//
+	// The IFF must stay open, and the chunks must not be touched, until
+	// their futures are ready.
+	//
+	class AsyncLoader
+	{
+		// A group of chunk reads sharing one future
+		struct Group
+		{
+			atomic<size_t>	left;
+			atomic<bool>	ok;
+			promise<bool>	result;
+		};
+
+		// One chunk read
+		struct Request
+		{
+			Chunk			*chunk;
+			Group			*group;
+			char			*buf;
+			uint64_t		len;
+			uint64_t		offset;
+			uint64_t		done;
+			struct iovec	iov;
+		};
+
+		int					fd;
+		unsigned			depth;		// Maximum reads in flight
+		mutex				lock;
+		deque<Request *>	queued;		// Waiting for Submit()
+		deque<Request *>	ready;		// Submitted, waiting for a free slot
+		bool				stopping;
+		atomic<uint64_t>	completed;
+
+		// io_uring state
+		int					ring;
+		unsigned			inflight;
+		unsigned			sqentries;
+		void				*sqmap, *cqmap, *sqemap;
+		size_t				sqmapsize, cqmapsize, sqemapsize;
+		unsigned			*sqhead, *sqtail, *sqmask, *sqarray;
+		unsigned			*cqhead, *cqtail, *cqmask;
+		void				*sqes, *cqes;
+		thread				reaper;
+
+		bool				ringfailed;	// Stopped working; the pool took over
+		unordered_set<Request *> sending;	// Handed to the kernel
+		vector<char *>		orphaned;	// Buffers the kernel may still hold
+
+		// Thread pool state
+		vector<thread>		workers;
+		unsigned			poolsize;
+		condition_variable	wake;
+
+		bool SetupRing();
+		void CloseRing();
+		void FillRing(bool wakeup=false);
+		void SubmitRing();
+		void Reap();
+		void Work();
+		void FallBack();
+		void Queue(Chunk *c, Group *g);
+		void Finish(Request *r, bool ok);
+	public:
+		AsyncLoader(IFF *iff, unsigned maxdepth=256, unsigned threads=0);
+		~AsyncLoader();
+		bool OK();
+		bool UsingUring();
+
+		future<bool> Load(Chunk *c);
+		future<bool> LoadAll(IFF *iff);
+		size_t Submit();
+		uint64_t GetCompleted();
+	};
+}	// End of IFFSpace
+#endif
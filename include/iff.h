@@ -12,7 +12,13 @@
 #include "string"
 #include "fstream"
 #include "map"
+#include "unordered_map"
 #include "vector"
+#include "span"
+#include "stdexcept"
+#include "type_traits"
+#include "thread"
+#include "cassert"
 
 
 namespace IFFSpace
@@ -24,6 +30,23 @@ namespace IFFSpace
 #define MAKE_ID(a,b,c,d,e,f,g,h) \
 ((uint64_t)(h) << 56 | (uint64_t)(g) << 48 | (uint64_t)(f) << 40 | (uint64_t)(e) << 32 \
 | (uint64_t)(d) << 24 | (uint64_t)(c) << 16 | (uint64_t)(b) << 8 | (uint64_t)(a))
+
+	// Compile-time equivalent taking a string literal of 1-8 printable
+	// ASCII characters, padded with spaces: MakeID("UTF8") == IFF_UTF8.
+	// Anything else is a compile error.
+	template<size_t N>
+	consteval uint64_t MakeID(const char (&s)[N])
+	{
+		static_assert(N >= 2 && N <= 9, "Chunk identifiers are 1 to 8 characters long");
+		uint64_t id = 0;
+		for(size_t i = 0; i < 8; i++)
+		{
+			char c = (i < N - 1) ? s[i] : ' ';
+			if(c < 0x20 || c > 0x7e) throw "Chunk identifiers must be printable ASCII";
+			id |= (uint64_t)(uint8_t)c << (i * 8);
+		}
+		return id;
+	}
 	
 #define IFF_FILEID MAKE_ID('I','F','F','6','4','B','I','T')		// An interchange file, containing any number of chunks (except zero)
 	
@@ -34,6 +57,8 @@ namespace IFFSpace
 #define IFF_COMP_UTF16	MAKE_ID('C','M','P','U','T','F','1','6')
 #define IFF_UTF32 MAKE_ID('U','T','F','3','2',' ',' ',' ')
 #define IFF_COMP_UTF32 MAKE_ID('C','M','P','U','T','F','3','2')
+#define IFF_BINARY MAKE_ID('B','I','N','A','R','Y',' ',' ')		// Arbitrary data, such as the contents of a file.
+#define IFF_COMP_BINARY MAKE_ID('C','O','M','P','B','I','N',' ')	// Compressed arbitrary data (first uint64 is the uncompressed size).
 
 #define IFF_FOLDER MAKE_ID('F','O','L','D','E','R',' ',' ')	// Collection of chunk data and properties for this data. Nest these for hierarchical data, like directory structures.
 #define IFF_VERSION MAKE_ID('V','E','R','S','I','O','N',' ')	// Version of a file or the current chunk.
@@ -44,6 +69,9 @@ namespace IFFSpace
 #define IFF_ANNOTATION MAKE_ID('A','N','N','O',' ',' ',' ',' ')	// Comment or annotation for the current chunk (UTF-8)
 #define IFF_AUTHOR MAKE_ID('A','U','T','H','O','R',' ',' ')		// Author of file. Usually a person. Use one per person. (UTF-8)
 #define IFF_ORIGIN MAKE_ID('O','R','I','G','I','N',' ',' ')		// A string with the program name and version used to create the file. (UTF-8)
+#define IFF_ZDICT MAKE_ID('Z','D','I','C','T',' ',' ',' ')		// Shared zlib dictionary for small compressed chunks. Must come before the chunks using it.
+
+	static_assert(MakeID("UTF8") == IFF_UTF8 && MakeID("IFF64BIT") == IFF_FILEID);
 
 	enum {
 		IFF_COMPRESSION_NONE=0,
@@ -70,13 +98,73 @@ namespace IFFSpace
 
 	typedef map<uint64_t, ChunkHook *> HookMap;
 	typedef map<uint64_t, bool> ContainerMap;
+	typedef map<uint64_t, uint64_t> ConversionMap;
+
+
+	//
+	// Chunk table
+	// A flat, structure-of-arrays copy of the chunk headers found
+	// while scanning. Entry i of each array describes the same chunk.
+	// Offsets point at the chunk data (just past the 16-byte header),
+	// and parents index the containing chunk, or IFF_NO_PARENT for
+	// chunks at the top level of the file.
+	//
+	// Bulk queries walk the arrays linearly, so they stay in cache
+	// and vectorise, unlike walking the Chunk objects.
+	//
+#define IFF_NO_PARENT UINT32_MAX
+	class ChunkTable
+	{
+	public:
+		vector<uint64_t>	ids;
+		vector<uint64_t>	offsets;
+		vector<uint64_t>	sizes;
+		vector<uint32_t>	parents;
+
+		uint32_t Add(uint64_t id, uint64_t offset, uint64_t size, uint32_t parent);
+		void Clear();
+		size_t NumChunks();
+		uint64_t GetFileSize();
+		uint64_t SumChildren(uint32_t parent);
+		uint64_t SumSizes(uint64_t id);
+		size_t Count(uint64_t id);
+		vector<size_t> Find(uint64_t id);
+		uint32_t GetDepth(size_t index);
+	};
+
+
+	//
+	// Compression dictionary set
+	// A shared zlib dictionary lets many small compressed chunks refer
+	// to common strings instead of each starting from an empty window.
+	// Dictionaries are stored in ZDICT chunks and looked up by their
+	// zlib dictionary ID, which is the Adler-32 checksum of the contents.
+	// Only chunks up to threshold bytes are compressed with the active
+	// dictionary; larger ones gain little from it.
+	//
+#define IFF_DICT_THRESHOLD 16384	// Default threshold, also used for dictionaries found in files
+	class DictionarySet
+	{
+	public:
+		map<uint32_t, string>	dicts;
+		uint32_t				active;		// Dictionary ID used when compressing, 0 for none
+		uint64_t				threshold;
+
+		DictionarySet() { active = 0; threshold = 0; }
+		uint32_t Add(const char *d, uint64_t s);
+		const string *Find(uint32_t dictid);
+		const string *GetActive(uint64_t size);
+		void Clear();
+		static string Train(vector<pair<const char *, uint64_t>> &samples, size_t maxsize);
+	};
 
 
 	//
 	// Chunk class
 	// IFFs have one or more of these. The IFF class refuses to write
 	// empty structures.
-	// The IFF class calls ReadHeader(), then either calls a hook
+	// The IFF class makes chunks from its scanned chunk table (or
+	// ReadHeader() can be used directly), then either calls a hook
 	// for the chunk type if supported, or lets the default chunk
 	// reader handle loading of chunk data.
 	//
@@ -86,7 +174,12 @@ namespace IFFSpace
 	// before going into array buffers, or script code.
 	//
 	class Chunk;
+	class IFF;
+	class SequentialWriter;
+	class PackedMap;
+	struct PackedChunk;
 	typedef vector<Chunk *> ChunkList;
+
 	class Chunk
 	{
 		// Chunk identifier (8 bytes)
@@ -94,38 +187,131 @@ namespace IFFSpace
 		uint64_t		size;			// Size of data. If this is an ARCHIVE, it's the size of all subchunks.
 		// Position in file when reading (found while scanning)
 		uint64_t		pos;
+		uint64_t		storedsize;		// Size of data in the file, as last scanned or saved
 		char			*data;			// The chunk contents, if loaded into memory
 		ChunkList		chunks;			// Sub-chunks (data is always NULL when these are used)
 		ContainerMap	*containers;
+		DictionarySet	*dictionaries;
+		// External data source, copied at save time instead of data
+		string			srcfile;
+		uint64_t		srcoffset;
+		bool			srcstored;		// Source holds the data as stored, already compressed if needed
 	public:
-		Chunk(uint64_t identifier, ContainerMap *cm);
+		Chunk(uint64_t identifier, ContainerMap *cm, DictionarySet *ds=nullptr);
 		Chunk(ContainerMap *cm) : Chunk(IFF_NAME, cm) {};
 		~Chunk();
 
 		uint64_t GetID();
 		uint64_t GetSize();
 		uint64_t GetFullSize();
+		uint64_t GetStoredSize();
+		uint64_t GetOffset();
+		char *GetData();
+		bool IsContainer();
 
 		void SetData(char *d, uint64_t s);
+		void AdoptData(char *d, uint64_t s);
 		uint64_t AddData(char *d, uint64_t s);
+		void SetSource(string file, uint64_t offset, uint64_t length);
+		bool SetSource(IFF *iff, Chunk *c);
+		bool HasSource();
+		void SetStored(uint64_t offset, uint64_t length);
+		void AppendChunk(Chunk *c);
 		Chunk *AddChunk(uint64_t identifier);
 		Chunk *AddChunk(uint64_t identifier, char *d, uint64_t s);
 		size_t NumChunks();
 		Chunk *GetChunk(size_t index);
 		bool WriteHeader(fstream *f);
-		bool WriteData(fstream *f);
+		bool WriteData(fstream *f, int fd=-1);
 		bool WriteDataZlib(fstream *f);
-		bool ReadHeader(fstream *f);
+		bool WriteDataSource(fstream *f, int fd);
+		bool WriteDataSourceZlib(fstream *f);
+		bool PackZlib(PackedMap *packed, PackedChunk *p);
+		bool Prepare(PackedMap *packed, uint64_t *stored);
+		bool WriteSequential(SequentialWriter *w, PackedMap *packed);
+		bool ReadHeader(fstream *f, ChunkTable *table=nullptr, uint32_t parent=IFF_NO_PARENT);
 		bool ReadData(fstream *f);
+		bool ReadDataZlib(fstream *f);
+		bool UnpackZlib(const char *stored, uint64_t len);
+		bool ConvertText(uint64_t to);
+		bool ApplyConversions(ConversionMap *conversions);
 		void Clear();
 	};
 
 
+	//
+	// Typed chunk view
+	// Gives zero-copy access to a loaded chunk's data as an array of T.
+	// Size and alignment are checked once when the view is made; if the
+	// data isn't a whole number of suitably aligned T, or isn't loaded,
+	// the view is empty and OK() returns false.
+	// at() is bounds-checked and throws out_of_range, like vector::at();
+	// operator[] only checks in debug builds. Span() covers exactly the
+	// items in the view. The view is only valid while the chunk's data is.
+	//
+	template<typename T>
+	class ChunkView
+	{
+		static_assert(is_trivially_copyable_v<T>, "ChunkView needs a plain data type");
+
+		T				*items;
+		size_t			count;
+		bool			ok;
+	public:
+		ChunkView(Chunk *c)
+		{
+			items = nullptr;
+			count = 0;
+			ok = false;
+			auto d = c->GetData();
+			auto s = c->GetSize();
+			if(s == 0)
+			{
+				ok = true;
+				return;
+			}
+			if(!d || (s % sizeof(T)) || ((uintptr_t)d % alignof(T))) return;
+
+			items = reinterpret_cast<T *>(d);
+			count = s / sizeof(T);
+			ok = true;
+		}
+		// Also require the chunk to have the given identifier.
+		ChunkView(Chunk *c, uint64_t identifier) : ChunkView(c)
+		{
+			if(c->GetID() != identifier)
+			{
+				items = nullptr;
+				count = 0;
+				ok = false;
+			}
+		}
+
+		bool OK() { return ok; }
+		size_t Size() { return count; }
+		T *begin() { return items; }
+		T *end() { return items + count; }
+		span<T> Span() { return span<T>(items, count); }
+		T &operator[](size_t index)
+		{
+			assert(index < count);
+			return items[index];
+		}
+		T &at(size_t index)
+		{
+			if(index >= count) throw out_of_range("ChunkView index out of range");
+			return items[index];
+		}
+	};
+
+
 	//
 	// Interchange file class
 	// This holds the name of an IFF, its filehandle,
 	// pointers to chunk headers with potentially more data,
 	// and custom hooks which handle user-defined chunk types.
+	// Opened for atomic writing, saves go to a temporary file next to
+	// the target, which replaces it only once completely written.
 	//
 	class IFF
 	{
@@ -135,18 +321,42 @@ namespace IFFSpace
 		HookMap			hooks;		// Custom handlers of chunks
 		ChunkList		chunks;		// All the actual contents
 		ContainerMap	containers;	// Chunks with sub-chunks
-		
+		ChunkTable		table;		// Flat copy of the scanned chunk headers
+		bool			lazy;		// Chunk objects not made from the table yet
+		bool			writable;	// Opened for writing; saving is refused otherwise
+		ConversionMap	loadconv;	// Text conversions applied after loading
+		ConversionMap	saveconv;	// Text conversions applied before saving
+		DictionarySet	dictionaries;	// Shared compression dictionaries
+		bool			atomic;		// Save to a temporary file, then rename
+		bool			background;	// Sync and rename on another thread
+		string			temppath;	// Temporary file being written, if any
+		thread			syncer;		// Background sync of the last save
+		bool			syncok;		// Result of the background sync
+
+		string SavePath();
+		bool BeginSave();
+		bool EndSave(bool ok);
+		bool OpenTemp();
+		void DropTemp();
+		void BuildChunks();
+
 	public:
-		IFF(string name, bool write=false);
+		IFF(string name, bool write=false, bool atomic=false);
 		~IFF();
 		bool OK();
+		string GetFilename();
 		void Erase();
-		bool Reopen(bool write=false);
+		bool Reopen(bool write=false, bool atomic=false);
 		uint64_t GetSize();
 		void RegisterContainer(uint64_t identifier);
 		void UnregisterContainer(uint64_t identifier);
 		void RegisterHook(ChunkHook *hook);
 		void UnregisterHook(ChunkHook *hook);
+		void ConvertOnLoad(uint64_t from, uint64_t to);
+		void ConvertOnSave(uint64_t from, uint64_t to);
+		bool TrainDictionary(size_t maxsize=32768, uint64_t threshold=IFF_DICT_THRESHOLD);
+		void SetDictionary(const char *d, uint64_t s, uint64_t threshold=IFF_DICT_THRESHOLD);
+		DictionarySet *GetDictionaries();
 		
 		void ScanFile();
 		bool LoadAllChunks();
@@ -155,8 +365,12 @@ namespace IFFSpace
 		Chunk *AddChunk(uint64_t id, char *d, uint64_t s);
 		size_t NumChunks();
 		Chunk *GetChunk(size_t index);
+		ChunkTable *GetTable();
 		size_t GetFileSize();
 		bool Save();
+		bool SaveSequential(bool direct=false);
+		void SyncInBackground(bool enable);
+		bool WaitForSave();
 	};
 }	// End of IFFSpace
 #endif
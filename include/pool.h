@@ -0,0 +1,87 @@
+//
+//  pool.h
+//  iff
+//
+//  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
+//
+
+#ifndef iff_pool_h
+#define iff_pool_h
+
+#include "cstdint"
+#include "zlib.h"
+
+namespace IFFSpace
+{
+	// Size of pooled I/O buffers.
+#define IFF_POOL_BUFSIZE (128 * 1024)
+	// Largest piece of input or output handed to zlib in one go, since
+	// its counters are 32-bit.
+#define IFF_ZLIB_MAXCHUNK (1U << 30)
+
+	//
+	// Compression statistics
+	// How many zlib contexts and I/O buffers were created, and how
+	// many times a pooled one was reused instead. Summed over all threads.
+	//
+	struct CompressionStats
+	{
+		uint64_t		deflateinits;
+		uint64_t		deflatereuses;
+		uint64_t		inflateinits;
+		uint64_t		inflatereuses;
+		uint64_t		bufferallocs;
+		uint64_t		bufferreuses;
+	};
+
+	CompressionStats GetCompressionStats();
+	void ResetCompressionStats();
+
+
+	//
+	// Pooled zlib contexts and buffers
+	// Each thread keeps the contexts and buffers it has finished with,
+	// and hands them out again after a reset instead of setting up new
+	// ones. Take one for the duration of a single chunk; it goes back
+	// to the pool when the object goes out of scope. They can't be
+	// copied, since each one must go back exactly once.
+	//
+	class PooledDeflate
+	{
+		z_stream		*z;
+	public:
+		PooledDeflate();
+		PooledDeflate(const PooledDeflate &) = delete;
+		PooledDeflate &operator=(const PooledDeflate &) = delete;
+		~PooledDeflate();
+		bool OK() { return z != nullptr; }
+		z_stream *Get() { return z; }
+	};
+
+
+	class PooledInflate
+	{
+		z_stream		*z;
+	public:
+		PooledInflate();
+		PooledInflate(const PooledInflate &) = delete;
+		PooledInflate &operator=(const PooledInflate &) = delete;
+		~PooledInflate();
+		bool OK() { return z != nullptr; }
+		z_stream *Get() { return z; }
+	};
+
+
+	class PooledBuffer
+	{
+		char			*buf;
+	public:
+		PooledBuffer();
+		PooledBuffer(const PooledBuffer &) = delete;
+		PooledBuffer &operator=(const PooledBuffer &) = delete;
+		~PooledBuffer();
+		char *Get() { return buf; }
+		uint64_t Size() { return IFF_POOL_BUFSIZE; }
+	};
+}	// End of IFFSpace
+#endif
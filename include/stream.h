@@ -0,0 +1,110 @@
+//
+//  stream.h
+//  iff
+//
+//  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
+//
+
+#ifndef iff_stream_h
+#define iff_stream_h
+
+#include "iff.h"
+#include "pool.h"
+
+namespace IFFSpace
+{
+	//
+	// Byte source class
+	// Anything the stream reader can pull bytes from, front to back.
+	// Read() returns the number of bytes read, and 0 at the end of
+	// input or on error. Sources never need to seek.
+	//
+	class ByteSource
+	{
+	public:
+		virtual ~ByteSource() {}
+		virtual uint64_t Read(char *buf, uint64_t len) = 0;
+	};
+
+
+	// Reads from a C++ input stream, such as cin or an ifstream.
+	class StreamSource : public ByteSource
+	{
+		istream			*in;
+	public:
+		StreamSource(istream *s) { in = s; }
+		uint64_t Read(char *buf, uint64_t len);
+	};
+
+
+	// Reads from a file descriptor, such as a pipe, socket or stdin.
+	class FileSource : public ByteSource
+	{
+		int				fd;
+	public:
+		FileSource(int descriptor) { fd = descriptor; }
+		uint64_t Read(char *buf, uint64_t len);
+	};
+
+
+	//
+	// Stream handler class
+	// Subclass this to receive chunks from a StreamReader.
+	// Depth is 0 for top-level chunks and increases inside containers.
+	//
+	class StreamHandler
+	{
+	public:
+		virtual ~StreamHandler() {}
+
+		// Return false to skip the data chunk. Size is as stored.
+		virtual bool Want(uint64_t /*id*/, uint64_t /*size*/, uint32_t /*depth*/) { return true; }
+		// Return false to skip a container and everything in it.
+		virtual bool EnterContainer(uint64_t /*id*/, uint64_t /*size*/, uint32_t /*depth*/) { return true; }
+		virtual void LeaveContainer(uint64_t /*id*/, uint32_t /*depth*/) {}
+		// Called with consecutive pieces of a wanted chunk's data.
+		// Offset is the position of the piece in the (decompressed) data.
+		// Return false to stop reading.
+		virtual bool Data(uint64_t id, const char *data, uint64_t len, uint64_t offset) = 0;
+		// Called after the last piece, with the total data size delivered.
+		virtual void EndChunk(uint64_t /*id*/, uint64_t /*size*/) {}
+	};
+
+
+	//
+	// Stream reader class
+	// Walks an IFF in a single forward pass, without seeking, so it
+	// can read from pipes and other non-seekable inputs.
+	// Unwanted chunks are drained and discarded. Compressed text chunks
+	// are decompressed on the fly unless decompression is turned off,
+	// using any shared dictionaries (ZDICT chunks) read before them.
+	// Memory use is bounded by two pooled buffers, whatever the chunk sizes.
+	//
+	class StreamReader
+	{
+		ByteSource		*src;
+		ContainerMap	containers;	// Chunks with sub-chunks
+		DictionarySet	dictionaries;	// Shared dictionaries seen so far
+		bool			decompress;
+		uint64_t		size;		// Size of rest of file contents, from the header
+		uint64_t		consumed;	// Bytes read so far, including the header
+		PooledBuffer	buf;
+		PooledBuffer	out;		// Decompressed data
+
+		bool ReadFully(char *dst, uint64_t len);
+		bool Drain(uint64_t len);
+		bool Walk(StreamHandler *handler, uint64_t end, uint32_t depth);
+		bool ReadDictionary(StreamHandler *handler, uint64_t len, uint32_t depth);
+		bool Deliver(StreamHandler *handler, uint64_t id, uint64_t len);
+		bool DeliverZlib(StreamHandler *handler, uint64_t id, uint64_t len);
+	public:
+		StreamReader(ByteSource *source, bool unpack=true);
+
+		void RegisterContainer(uint64_t identifier);
+		void UnregisterContainer(uint64_t identifier);
+		uint64_t GetSize();
+		uint64_t GetConsumed();
+		bool Run(StreamHandler *handler);
+	};
+}	// End of IFFSpace
+#endif
@@ -0,0 +1,40 @@
+//
+//  text.h
+//  iff
+//
+//  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
+//
+
+#ifndef iff_text_h
+#define iff_text_h
+
+#include "cstdint"
+
+namespace IFFSpace
+{
+	// Text chunks hold UTF-8, UTF-16 or UTF-32 in the host's byte
+	// order, like every other number in the file (little-endian on the
+	// platforms this builds for), without a byte order mark. The compressed
+	// variants hold the same encodings once decompressed.
+	// ASCII is treated as a strict subset of UTF-8.
+	// Compressed binary chunks count as compressed, but not as text.
+
+	bool IsTextID(uint64_t id);
+	bool IsCompressedID(uint64_t id);
+	uint64_t GetPlainID(uint64_t id);
+	uint64_t GetCompressedID(uint64_t id);
+	unsigned GetTextUnitSize(uint64_t id);
+
+	// Validation. Sizes are in code units, not bytes.
+	bool ValidateASCII(const char *s, uint64_t len);
+	bool ValidateUTF8(const char *s, uint64_t len);
+	bool ValidateUTF16(const char16_t *s, uint64_t count);
+	bool ValidateUTF32(const char32_t *s, uint64_t count);
+	bool ValidateText(uint64_t id, const char *data, uint64_t size);
+
+	// Convert size bytes of text of type from into a newly allocated
+	// buffer of type to. The caller owns *dst afterwards.
+	// Returns false on invalid input or allocation failure.
+	bool TranscodeText(uint64_t from, const char *src, uint64_t size, uint64_t to, char **dst, uint64_t *dstsize);
+}	// End of IFFSpace
+#endif
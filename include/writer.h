@@ -0,0 +1,88 @@
+//
+//  writer.h
+//  iff
+//
+//  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
+//
+
+#ifndef iff_writer_h
+#define iff_writer_h
+
+#include "iff.h"
+
+namespace IFFSpace
+{
+	// Size of the write buffer, and the alignment needed for O_DIRECT.
+#define IFF_WRITER_BUFSIZE (4 * 1024 * 1024)
+#define IFF_WRITER_ALIGN 4096
+	// Compressed data kept in memory ahead of a sequential save.
+#define IFF_PACKED_MAXMEM (16 * 1024 * 1024)
+
+	//
+	// Sequential writer class
+	// Writes a file of known size front to back, in large blocks from
+	// one aligned buffer. The whole file is preallocated up front so it
+	// can be laid out contiguously. With direct, writes bypass the page
+	// cache where the filesystem allows it.
+	//
+	class SequentialWriter
+	{
+		int				fd;
+		char			*buf;
+		uint64_t		fill;		// Bytes waiting in the buffer
+		uint64_t		offset;		// File position of the start of the buffer
+		bool			direct;
+		bool			ok;
+
+		bool Flush(bool final);
+	public:
+		SequentialWriter(string path, uint64_t total, bool odirect=false);
+		~SequentialWriter();
+		bool OK();
+		bool IsDirect();
+		uint64_t Tell();
+		bool Write(const void *d, uint64_t len);
+		bool Copy(const string &file, uint64_t from, uint64_t len);
+		bool Copy(int in, uint64_t from, uint64_t len);
+		bool Finish();
+		int GetFD();
+	};
+
+
+	// Stored size of a chunk, and its compressed data when it has any.
+	// Spilled data lives in the scratch file at offset instead of in data.
+	struct PackedChunk
+	{
+		uint64_t		stored;
+		uint64_t		offset;
+		string			data;
+		bool			spilled;
+	};
+
+
+	//
+	// Packed chunk map
+	// Stored sizes, and compressed data, worked out ahead of a sequential
+	// save. Up to IFF_PACKED_MAXMEM bytes of compressed data are kept in
+	// memory; the rest goes to an unlinked scratch file next to the target
+	// and is copied from there while writing.
+	//
+	class PackedMap
+	{
+		unordered_map<Chunk *, PackedChunk> chunks;
+		string			near;		// Scratch file goes next to this
+		int				scratch;
+		uint64_t		end;		// Bytes in the scratch file
+		uint64_t		held;		// Bytes kept in memory
+
+		bool Spill(const char *d, uint64_t len);
+	public:
+		PackedMap(string target);
+		~PackedMap();
+		PackedChunk *Add(Chunk *c);
+		PackedChunk *Find(Chunk *c);
+		bool Append(PackedChunk *p, const void *d, uint64_t len);
+		bool Write(SequentialWriter *w, PackedChunk *p);
+	};
+}	// End of IFFSpace
+#endif
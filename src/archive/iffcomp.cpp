@@ -5,7 +5,9 @@
 //  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
 //
 
+#include <sys/stat.h>
 #include "iff.h"
+#include "pool.h"
 #include "getopt.h"
 
 #define PROGRAM "iffcomp"
@@ -17,6 +19,7 @@ using namespace IFFSpace;
 #define IFF_ARCHIVE MAKE_ID('A','R','C','H','I','V','E',' ')
 
 void usage();
+void stats(const char *what);
 
 void usage()
 {
@@ -30,6 +33,17 @@ void usage()
 
 typedef std::vector<std::string> Files;
 
+// Show how much the compression pools saved
+void stats(const char *what)
+{
+	auto s = GetCompressionStats();
+	cout << what << ": " << s.deflateinits << " deflate contexts for " << s.deflateinits + s.deflatereuses << " chunks, "
+		<< s.inflateinits << " inflate contexts for " << s.inflateinits + s.inflatereuses << " chunks, "
+		<< s.bufferallocs << " buffers allocated for " << s.bufferallocs + s.bufferreuses << " uses.\n";
+	ResetCompressionStats();
+}
+
+
 int main(int argc, char * const *argv)
 {
 	static struct option longopts[] = {
@@ -93,10 +107,23 @@ int main(int argc, char * const *argv)
 		return 2;
 	}
 
-	string s = "This is some testdata with a suitably long string to test the compression methods in the IFF classes.";
-	iff->AddChunk(IFF_NAME, (char *)files[0].c_str(), files[0].size());
-	iff->AddChunk(IFF_COMP_UTF8, (char *)s.c_str(), s.size());
+	// Each file goes into a folder with its name and compressed contents.
+	// The contents are read straight from the file while saving.
+	for(auto &file : files)
+	{
+		struct stat st;
+		if(stat(file.c_str(), &st) != 0)
+		{
+			cout << "Couldn't find '" << file << "'.\n";
+			return 2;
+		}
+
+		auto c = iff->AddChunk(IFF_FOLDER);
+		c->AddChunk(IFF_NAME, (char *)file.c_str(), file.size());
+		c->AddChunk(IFF_COMP_BINARY)->SetSource(file, 0, (uint64_t)st.st_size);
+	}
 	iff->Save();
+	stats("Compression");
 
 	// Verify
 	iff->Reopen();
@@ -110,6 +137,8 @@ int main(int argc, char * const *argv)
 	auto aSize = iff->GetFileSize();
 	auto aChunks = iff->NumChunks();
 	cout << "Opened file with " << aChunks << " chunks, totalling " << aSize <<" bytes.\n";
+	iff->LoadAllChunks();
+	stats("Decompression");
 
 	delete iff;
 	return 0;
@@ -0,0 +1,506 @@
+//
+//  async.cpp
+//  Asynchronous chunk loading through io_uring or a thread pool.
+//
+//  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
+//
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "async.h"
+#include "text.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define IFF_IO_URING
+#endif
+#endif
+
+namespace IFFSpace
+{
+	// Largest single read handed to the kernel. Longer chunks are read
+	// in several steps, as are any short reads.
+	#define ASYNC_MAXREAD (1 << 30)
+
+#pragma mark AsyncLoader constructor
+	// Open the IFF's file for reading. Threads is the size of the pool
+	// used when io_uring isn't available; 0 picks one per CPU.
+	AsyncLoader::AsyncLoader(IFF *iff, unsigned maxdepth, unsigned threads)
+	{
+		depth = maxdepth ? maxdepth : 1;
+		stopping = false;
+		completed = 0;
+		ring = -1;
+		ringfailed = false;
+		inflight = 0;
+		sqentries = 0;
+		sqmap = cqmap = sqemap = nullptr;
+		sqmapsize = cqmapsize = sqemapsize = 0;
+		poolsize = threads ? threads : max(4u, thread::hardware_concurrency());
+		fd = open(iff->GetFilename().c_str(), O_RDONLY);
+		if(fd < 0) return;
+
+		if(SetupRing())
+		{
+			reaper = thread(&AsyncLoader::Reap, this);
+			return;
+		}
+
+		for(unsigned i = 0; i < poolsize; i++)
+			workers.push_back(thread(&AsyncLoader::Work, this));
+	}
+
+
+#pragma mark AsyncLoader destructor
+	// Reads already submitted are finished first.
+	// Reads queued but never submitted fail.
+	AsyncLoader::~AsyncLoader()
+	{
+		deque<Request *> unsent;
+		{
+			lock_guard<mutex> l(lock);
+			stopping = true;
+			unsent.swap(queued);
+			FillRing(true);
+		}
+		for(auto r : unsent) Finish(r, false);
+
+		// The reaper may start the pool, so it goes first.
+		wake.notify_all();
+		if(reaper.joinable()) reaper.join();
+		wake.notify_all();
+		for(auto &t : workers) t.join();
+		CloseRing();
+		for(auto b : orphaned) delete[] b;
+		if(fd >= 0) close(fd);
+	}
+
+
+	bool AsyncLoader::OK()
+	{
+		return fd >= 0;
+	}
+
+
+	bool AsyncLoader::UsingUring()
+	{
+		lock_guard<mutex> l(lock);
+		return ring >= 0 && !ringfailed;
+	}
+
+
+	// Number of chunk reads finished so far, successful or not.
+	uint64_t AsyncLoader::GetCompleted()
+	{
+		return completed;
+	}
+
+
+#pragma mark Queueing
+	// Queue a chunk, or all the chunks inside a container.
+	// The future is true once all of them are loaded.
+	// Nothing is read until Submit() is called.
+	future<bool> AsyncLoader::Load(Chunk *c)
+	{
+		auto g = new Group;
+		// Hold the group open while queueing.
+		g->left = 1;
+		g->ok = true;
+		auto f = g->result.get_future();
+		if(OK())
+			Queue(c, g);
+		else
+			g->ok = false;
+
+		if(--g->left == 0)
+		{
+			g->result.set_value(g->ok);
+			delete g;
+		}
+		return f;
+	}
+
+
+	// Queue every chunk in the IFF under one future.
+	future<bool> AsyncLoader::LoadAll(IFF *iff)
+	{
+		auto g = new Group;
+		g->left = 1;
+		g->ok = true;
+		auto f = g->result.get_future();
+		if(OK())
+		{
+			for(size_t i = 0; i < iff->NumChunks(); i++) Queue(iff->GetChunk(i), g);
+		} else {
+			g->ok = false;
+		}
+
+		if(--g->left == 0)
+		{
+			g->result.set_value(g->ok);
+			delete g;
+		}
+		return f;
+	}
+
+
+	void AsyncLoader::Queue(Chunk *c, Group *g)
+	{
+		if(c->IsContainer())
+		{
+			for(size_t i = 0; i < c->NumChunks(); i++) Queue(c->GetChunk(i), g);
+			return;
+		}
+		// Already loaded, or nothing to load.
+		if(c->GetData() || c->GetSize() == 0) return;
+
+		auto r = new Request;
+		r->chunk = c;
+		r->group = g;
+		r->len = c->GetSize();
+		r->offset = c->GetOffset();
+		r->done = 0;
+		r->buf = new char[r->len];
+		g->left++;
+		lock_guard<mutex> l(lock);
+		queued.push_back(r);
+	}
+
+
+	// Start all queued reads and return how many there were.
+	size_t AsyncLoader::Submit()
+	{
+		size_t n;
+		{
+			lock_guard<mutex> l(lock);
+			n = queued.size();
+			for(auto r : queued) ready.push_back(r);
+			queued.clear();
+			FillRing();
+		}
+		wake.notify_all();
+		return n;
+	}
+
+
+	// Hand a finished read's buffer to its chunk and complete the group.
+	// Compressed chunks are decompressed here, off the caller's thread.
+	void AsyncLoader::Finish(Request *r, bool ok)
+	{
+		if(ok)
+		{
+			if(IsCompressedID(r->chunk->GetID()))
+			{
+				ok = r->chunk->UnpackZlib(r->buf, r->len);
+				delete[] r->buf;
+			} else {
+				r->chunk->AdoptData(r->buf, r->len);
+			}
+		} else {
+			delete[] r->buf;
+		}
+
+		auto g = r->group;
+		delete r;
+		if(!ok) g->ok = false;
+		completed++;
+		if(--g->left == 0)
+		{
+			g->result.set_value(g->ok);
+			delete g;
+		}
+	}
+
+
+#pragma mark Thread pool
+	void AsyncLoader::Work()
+	{
+		while(true)
+		{
+			Request *r;
+			{
+				unique_lock<mutex> l(lock);
+				wake.wait(l, [this]{ return stopping || !ready.empty(); });
+				if(ready.empty()) return;
+
+				r = ready.front();
+				ready.pop_front();
+			}
+
+			bool ok = true;
+			while(ok && r->done < r->len)
+			{
+				auto n = pread(fd, r->buf + r->done, (size_t)min(r->len - r->done, (uint64_t)ASYNC_MAXREAD), (off_t)(r->offset + r->done));
+				if(n < 0 && errno == EINTR) continue;
+
+				if(n <= 0)
+					ok = false;
+				else
+					r->done += (uint64_t)n;
+			}
+			Finish(r, ok);
+		}
+	}
+
+
+	// The ring stopped working. Hand everything outstanding to a pool
+	// of threads reading with pread() instead. Reads the kernel may still
+	// hold start again in fresh buffers; the old ones are only freed
+	// once the ring has been closed. Call with the lock held.
+	void AsyncLoader::FallBack()
+	{
+		if(ringfailed) return;
+
+		ringfailed = true;
+		for(auto r : sending)
+		{
+			orphaned.push_back(r->buf);
+			r->buf = new char[r->len];
+			r->done = 0;
+			ready.push_front(r);
+		}
+		sending.clear();
+		inflight = 0;
+		for(unsigned i = 0; i < poolsize; i++)
+			workers.push_back(thread(&AsyncLoader::Work, this));
+		wake.notify_all();
+	}
+
+
+#pragma mark io_uring
+#ifdef IFF_IO_URING
+	// Map the submission and completion rings.
+	// Returns false if io_uring can't be used here.
+	bool AsyncLoader::SetupRing()
+	{
+		struct io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		ring = (int)syscall(__NR_io_uring_setup, depth, &p);
+		if(ring < 0)
+		{
+			ring = -1;
+			return false;
+		}
+
+		sqmapsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cqmapsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+		if(single) sqmapsize = cqmapsize = max(sqmapsize, cqmapsize);
+
+		sqmap = mmap(nullptr, sqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+		if(sqmap == MAP_FAILED) sqmap = nullptr;
+		if(single)
+		{
+			cqmap = sqmap;
+		} else if(sqmap) {
+			cqmap = mmap(nullptr, cqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+			if(cqmap == MAP_FAILED) cqmap = nullptr;
+		}
+		sqemapsize = p.sq_entries * sizeof(struct io_uring_sqe);
+		sqemap = mmap(nullptr, sqemapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+		if(sqemap == MAP_FAILED) sqemap = nullptr;
+		if(!sqmap || !cqmap || !sqemap)
+		{
+			CloseRing();
+			return false;
+		}
+
+		auto sq = (char *)sqmap;
+		auto cq = (char *)cqmap;
+		sqhead = (unsigned *)(sq + p.sq_off.head);
+		sqtail = (unsigned *)(sq + p.sq_off.tail);
+		sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+		sqarray = (unsigned *)(sq + p.sq_off.array);
+		cqhead = (unsigned *)(cq + p.cq_off.head);
+		cqtail = (unsigned *)(cq + p.cq_off.tail);
+		cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+		sqes = sqemap;
+		cqes = cq + p.cq_off.cqes;
+		sqentries = p.sq_entries;
+		depth = min(depth, p.sq_entries);
+		return true;
+	}
+
+
+	void AsyncLoader::CloseRing()
+	{
+		if(sqemap) munmap(sqemap, sqemapsize);
+		if(cqmap && cqmap != sqmap) munmap(cqmap, cqmapsize);
+		if(sqmap) munmap(sqmap, sqmapsize);
+		sqmap = cqmap = sqemap = nullptr;
+		if(ring >= 0) close(ring);
+		ring = -1;
+	}
+
+
+	// Move ready reads into the submission ring, up to the depth limit,
+	// and submit them with one system call. With wakeup, a no-op is
+	// added so that the reaper wakes up and notices it should stop.
+	// Called with the lock held.
+	void AsyncLoader::FillRing(bool wakeup)
+	{
+		if(ring < 0 || ringfailed) return;
+
+		unsigned tail = *sqtail;
+		unsigned head = __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+		unsigned count = 0;
+		auto entries = (struct io_uring_sqe *)sqes;
+		while(!ready.empty() && inflight < depth && tail - head < sqentries)
+		{
+			auto r = ready.front();
+			ready.pop_front();
+			auto index = tail & *sqmask;
+			auto sqe = &entries[index];
+			memset(sqe, 0, sizeof(*sqe));
+			r->iov.iov_base = r->buf + r->done;
+			r->iov.iov_len = (size_t)min(r->len - r->done, (uint64_t)ASYNC_MAXREAD);
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd = fd;
+			sqe->addr = (uint64_t)(uintptr_t)&r->iov;
+			sqe->len = 1;
+			sqe->off = r->offset + r->done;
+			sqe->user_data = (uint64_t)(uintptr_t)r;
+			sending.insert(r);
+			sqarray[index] = index;
+			tail++;
+			count++;
+			inflight++;
+		}
+		if(wakeup && tail - head < sqentries)
+		{
+			auto index = tail & *sqmask;
+			auto sqe = &entries[index];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_NOP;
+			sqe->user_data = 0;
+			sqarray[index] = index;
+			tail++;
+			count++;
+		}
+		if(count == 0) return;
+
+		__atomic_store_n(sqtail, tail, __ATOMIC_RELEASE);
+		SubmitRing();
+	}
+
+
+	// Hand the kernel every entry it hasn't taken yet. Entries it can't
+	// take right now stay queued, and the reaper offers them again each
+	// time it waits. Any other error hands everything to the thread pool.
+	// Call with the lock held.
+	void AsyncLoader::SubmitRing()
+	{
+		while(true)
+		{
+			unsigned pending = *sqtail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+			if(pending == 0) return;
+
+			auto ret = syscall(__NR_io_uring_enter, ring, pending, 0, 0, nullptr, 0);
+			if(ret < 0 && errno == EINTR) continue;
+			// Out of resources, or the reaper got to them first.
+			if(ret == 0 || (ret < 0 && (errno == EAGAIN || errno == EBUSY))) return;
+			if(ret < 0)
+			{
+				FallBack();
+				return;
+			}
+		}
+	}
+
+
+	// Wait for completions, resubmit short reads and finish the rest.
+	// Entries the kernel couldn't take yet are submitted along the way.
+	// Runs on its own thread until stopping and nothing is left in flight.
+	// If the ring fails for good, the thread pool takes over.
+	void AsyncLoader::Reap()
+	{
+		auto entries = (struct io_uring_cqe *)cqes;
+		vector<pair<Request *, bool>> finished;
+		while(true)
+		{
+			unsigned pending;
+			{
+				lock_guard<mutex> l(lock);
+				if(ringfailed) return;
+
+				pending = *sqtail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+			}
+			auto ret = syscall(__NR_io_uring_enter, ring, pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+			// Busy means completions are waiting to be reaped.
+			if(ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			{
+				lock_guard<mutex> l(lock);
+				FallBack();
+				return;
+			}
+
+			finished.clear();
+			{
+				lock_guard<mutex> l(lock);
+				unsigned head = *cqhead;
+				unsigned tail = __atomic_load_n(cqtail, __ATOMIC_ACQUIRE);
+				while(head != tail)
+				{
+					auto cqe = &entries[head & *cqmask];
+					auto r = (Request *)(uintptr_t)cqe->user_data;
+					auto res = cqe->res;
+					head++;
+					if(!r) continue;
+
+					sending.erase(r);
+					inflight--;
+					if(res == -EINTR || res == -EAGAIN)
+					{
+						ready.push_front(r);
+					} else if(res <= 0) {
+						finished.push_back({r, false});
+					} else {
+						r->done += (uint64_t)res;
+						if(r->done < r->len)
+							ready.push_front(r);
+						else
+							finished.push_back({r, true});
+					}
+				}
+				__atomic_store_n(cqhead, head, __ATOMIC_RELEASE);
+				FillRing();
+			}
+
+			for(auto &f : finished) Finish(f.first, f.second);
+
+			lock_guard<mutex> l(lock);
+			if(stopping && inflight == 0 && ready.empty()) break;
+		}
+	}
+#else
+	bool AsyncLoader::SetupRing()
+	{
+		return false;
+	}
+
+
+	void AsyncLoader::CloseRing()
+	{
+	}
+
+
+	void AsyncLoader::FillRing(bool wakeup)
+	{
+	}
+
+
+	void AsyncLoader::SubmitRing()
+	{
+	}
+
+
+	void AsyncLoader::Reap()
+	{
+	}
+#endif
+} // End namespace IFFSpace
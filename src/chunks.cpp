@@ -6,33 +6,50 @@
 //
 
 #include <stdio.h>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
 #include "iff.h"
+#include "pool.h"
+#include "text.h"
+#include "writer.h"
 
 
 namespace IFFSpace
 {
 #pragma mark Chunk constructor
 	// Initialise chunk with an identifier
-	Chunk::Chunk(uint64_t identifier, ContainerMap *cm)
+	Chunk::Chunk(uint64_t identifier, ContainerMap *cm, DictionarySet *ds)
 	{
 		id = identifier;
 		size = 0;
+		storedsize = 0;
 		data = nullptr;
 		containers = cm;
+		dictionaries = ds;
+		srcoffset = 0;
+		srcstored = false;
 	}
 
 
 #pragma mark Chunk destructor
+	// Frees the data and any sub-chunks.
 	Chunk::~Chunk()
 	{
-		//if(data) delete data;
+		Clear();
+		for(auto c : chunks) delete c;
 	}
 
 
 #pragma mark Reading Chunk data
 	// Read chunk identifier and size.
+	// Sub-chunks of containers are scanned recursively, and the
+	// file is left positioned just past the end of this chunk.
+	// If a table is supplied, this chunk and its sub-chunks are
+	// appended to it.
 	// Returns true if successful.
-	bool Chunk::ReadHeader(fstream *f)
+	bool Chunk::ReadHeader(fstream *f, ChunkTable *table, uint32_t parent)
 	{
 		f->read((char *)&id, 8);
 		if(f->good()) f->read((char *)&size, sizeof(size));
@@ -40,22 +57,30 @@ namespace IFFSpace
 		// of order by calling programs, rather than having to
 		// parse each chunk again.
 		pos = (uint64_t)f->tellg();
+		storedsize = size;
+		if(!f->good()) return false;
+
+		uint32_t index = IFF_NO_PARENT;
+		if(table)
+		{
+			index = table->Add(id, pos, size, parent);
+			if(index == IFF_NO_PARENT) return false;
+		}
 		if(containers->find(id) != containers->end())
 		{
-			while(pos < size)
+			uint64_t end = pos + size;
+			uint64_t cur = pos;
+			while(cur < end)
 			{
-				auto c = new Chunk(IFF_UTF8, containers);
-				if(c)
-				{
-					chunks.push_back(c);
-					c->ReadHeader(f);
-					f->seekg((off_t)c->GetSize(), ios::cur);
-					pos = (uint64_t)f->tellg();
-				} else {
-					return false;
-				}
+				auto c = new Chunk(IFF_UTF8, containers, dictionaries);
+				if(!c) return false;
+
+				chunks.push_back(c);
+				if(!c->ReadHeader(f, table, index)) return false;
+				cur = c->GetOffset() + c->GetSize();
 			}
 		}
+		f->seekg((off_t)(pos + size), ios::beg);
 		return f->good();
 	}
 
@@ -73,7 +98,12 @@ namespace IFFSpace
 
 		if(containers->find(id) != containers->end())
 		{
-			for(auto c : chunks) c->ReadData(f);
+			// Empty sub-chunks are saved too, and have nothing to load.
+			bool ok = true;
+			for(auto c : chunks) ok &= c->ReadData(f) || c->GetSize() == 0;
+			return ok;
+		} else if(IsCompressedID(id)) {
+			return ReadDataZlib(f);
 		} else {
 			data = new char[size];
 			if(!data) return false;
@@ -92,6 +122,8 @@ namespace IFFSpace
 
 
 	// Return size of contents.
+	// Compressed chunks are the size as stored until loaded, and the
+	// uncompressed size afterwards; GetStoredSize() has the former.
 	uint64_t Chunk::GetSize()
 	{
 		if((size == 0) && (chunks.size()))
@@ -110,6 +142,35 @@ namespace IFFSpace
 	}
 
 
+	// Return the size of the chunk's data in the file, as last scanned
+	// or saved, or 0 if it has been neither.
+	uint64_t Chunk::GetStoredSize()
+	{
+		return storedsize;
+	}
+
+
+	// Return the position of the chunk's data in the file.
+	uint64_t Chunk::GetOffset()
+	{
+		return pos;
+	}
+
+
+	bool Chunk::IsContainer()
+	{
+		return containers->find(id) != containers->end();
+	}
+
+
+	// Return the chunk contents, or nullptr if not loaded.
+	// Compressed chunks are decompressed when loaded.
+	char *Chunk::GetData()
+	{
+		return data;
+	}
+
+
 #pragma mark Writing Chunk data
 	// Write the identifier and size
 	// Returns false on failure
@@ -120,45 +181,223 @@ namespace IFFSpace
 		{
 			f->write((char *)&size, sizeof(size));
 			pos = (uint64_t)f->tellp();
+			storedsize = size;
 		}
 		return f->good();
 	}
 
 
-	bool Chunk::WriteData(fstream *f)
+	// Write the chunk's data after its header.
+	// If fd is an open descriptor for the same file, chunks with an
+	// external source are copied by the kernel instead of through
+	// user space.
+	bool Chunk::WriteData(fstream *f, int fd)
 	{
+		if(HasSource()) return WriteDataSource(f, fd);
+
+		bool ok = true;
 		if(containers->find(id) != containers->end())
 		{
 			for(auto c : chunks)
 			{
-				c->WriteHeader(f);
-				c->WriteData(f);
+				ok &= c->WriteHeader(f);
+				ok &= c->WriteData(f, fd);
+			}
+			// Compressed sub-chunks shrink while being written,
+			// so patch the header with the size actually used.
+			auto written = (uint64_t)f->tellp() - pos;
+			if(written != size)
+			{
+				f->seekp((off_t)pos - 8, ios::beg);
+				f->write((char *)&written, 8);
+				f->seekp((off_t)(pos + written), ios::beg);
+				storedsize = written;
 			}
+		} else if(IsCompressedID(id)) {
+			// Compress with zlib
+			ok = WriteDataZlib(f);
 		} else {
-			switch(id)
+			// Nothing loaded to write.
+			if(size && !data) return false;
+
+			f->write((char *)data, (streamsize)size);
+		}
+		return ok && f->good();
+	}
+
+
+	// Copy the source range into the file.
+	// Plain data going into a compressed chunk is compressed on the way.
+	bool Chunk::WriteDataSource(fstream *f, int fd)
+	{
+		if(!srcstored && IsCompressedID(id)) return WriteDataSourceZlib(f);
+
+		int in = open(srcfile.c_str(), O_RDONLY);
+		if(in < 0) return false;
+
+		f->flush();
+		uint64_t out = (uint64_t)f->tellp();
+		uint64_t done = 0;
+#ifdef __linux__
+		if(fd >= 0)
+		{
+			loff_t inoff = (loff_t)srcoffset;
+			loff_t outoff = (loff_t)out;
+			while(done < size)
 			{
-				case IFF_COMP_UTF8:
-				case IFF_COMP_UTF16:
-				case IFF_COMP_UTF32:
-					// Compress with zlib
-					WriteDataZlib(f);
-					break;
-					
-				default:
-					f->write((char *)data, (streamsize)size);
-					break;
+				auto n = copy_file_range(in, &inoff, fd, &outoff, (size_t)min(size - done, (uint64_t)1 << 30), 0);
+				if(n <= 0) break;
+
+				done += (uint64_t)n;
 			}
+			f->seekp((off_t)(out + done), ios::beg);
 		}
+#endif
+		// Copy anything the kernel couldn't through a bounded buffer.
+		PooledBuffer buf;
+		while(done < size)
+		{
+			auto n = pread(in, buf.Get(), (size_t)min(size - done, buf.Size()), (off_t)(srcoffset + done));
+			if(n <= 0)
+			{
+				close(in);
+				return false;
+			}
+
+			f->write(buf.Get(), (streamsize)n);
+			done += (uint64_t)n;
+		}
+		close(in);
 		return f->good();
 	}
 
 
+#pragma mark Sequential writing
+	// Work out how many bytes this chunk's data takes up in the file,
+	// without writing anything. Compressed chunks are compressed here,
+	// and the result kept in packed for WriteSequential().
+	bool Chunk::Prepare(PackedMap *packed, uint64_t *stored)
+	{
+		if(HasSource() && (srcstored || !IsCompressedID(id)))
+		{
+			*stored = size;
+			return true;
+		}
+
+		if(containers->find(id) != containers->end())
+		{
+			uint64_t total = 0;
+			for(auto c : chunks)
+			{
+				uint64_t n;
+				if(!c->Prepare(packed, &n)) return false;
+
+				total += n + 16;
+			}
+			packed->Add(this)->stored = total;
+			*stored = total;
+			return true;
+		}
+
+		// Nothing loaded to write. Caught here, before the file is touched.
+		if(size && !data) return false;
+
+		if(IsCompressedID(id))
+		{
+			auto p = packed->Add(this);
+			if(!PackZlib(packed, p)) return false;
+
+			*stored = p->stored;
+			return true;
+		}
+
+		*stored = size;
+		return true;
+	}
+
+
+	// Write the header and data front to back, using the sizes and
+	// compressed data from Prepare(). Nothing is ever patched afterwards.
+	bool Chunk::WriteSequential(SequentialWriter *w, PackedMap *packed)
+	{
+		auto p = packed->Find(this);
+		uint64_t stored = p ? p->stored : size;
+		w->Write(&id, 8);
+		w->Write(&stored, 8);
+		pos = w->Tell();
+		storedsize = stored;
+
+		if(HasSource() && (srcstored || !IsCompressedID(id)))
+			return w->Copy(srcfile, srcoffset, size);
+
+		if(containers->find(id) != containers->end())
+		{
+			for(auto c : chunks)
+				if(!c->WriteSequential(w, packed)) return false;
+			return w->OK();
+		}
+
+		if(p) return packed->Write(w, p);
+
+		if(size && !data) return false;
+		return w->Write(data, size);
+	}
+
+
+#pragma mark Text conversion
+	// Convert loaded text data to another text type.
+	// Compressed and plain variants of the same encoding share
+	// the same in-memory data, so only the identifier changes.
+	// Returns false if either type isn't text, or the data is invalid.
+	bool Chunk::ConvertText(uint64_t to)
+	{
+		if(!IsTextID(id) || !IsTextID(to)) return false;
+
+		if(GetPlainID(id) != GetPlainID(to))
+		{
+			if(size && !data) return false;
+
+			char *ndata;
+			uint64_t nsize;
+			if(!TranscodeText(id, data, size, to, &ndata, &nsize)) return false;
+
+			if(data) delete[] data;
+			data = ndata;
+			size = nsize;
+		}
+		id = to;
+		return true;
+	}
+
+
+	// Apply text conversions to this chunk and any sub-chunks.
+	// Chunks with a source are copied as they are, so they're left alone.
+	// Returns false if any conversion failed.
+	bool Chunk::ApplyConversions(ConversionMap *conversions)
+	{
+		if(HasSource()) return true;
+
+		bool ok = true;
+		if(containers->find(id) != containers->end())
+		{
+			for(auto c : chunks) ok &= c->ApplyConversions(conversions);
+			// Sub-chunk sizes may have changed; recalculate on demand.
+			size = 0;
+			return ok;
+		}
+
+		auto conv = conversions->find(id);
+		if(conv != conversions->end()) ok = ConvertText(conv->second);
+		return ok;
+	}
+
+
 	// Free the buffers
 	void Chunk::Clear()
 	{
 		if(data)
 		{
-			delete data;
+			delete[] data;
 			data = nullptr;
 		}
 	}
@@ -169,6 +408,10 @@ namespace IFFSpace
 	// The chunk is now responsible for deallocating the memory when appropriate.
 	void Chunk::SetData(char *d, uint64_t s)
 	{
+		Clear();
+		size = 0;
+		if(!d || !s) return;
+
 		data = new char[s];
 		if(data)
 		{
@@ -178,6 +421,16 @@ namespace IFFSpace
 	}
 
 
+	// Hand a buffer allocated with new[] to the chunk without copying.
+	// The chunk is now responsible for deallocating it.
+	void Chunk::AdoptData(char *d, uint64_t s)
+	{
+		Clear();
+		data = d;
+		size = s;
+	}
+
+
 	// Append data to the chunk and return the new size of the chunk.
 	// Reallocates data if needed, and returns 0 if allocation fails.
 	// Commonly used for compression. Caller is responsible for
@@ -197,7 +450,7 @@ namespace IFFSpace
 
 			memcpy(ndata, data, size);
 			memcpy((char *)ndata+size, d, s);
-			delete data;
+			delete[] data;
 			data = ndata;
 			size += s;
 		}
@@ -205,6 +458,65 @@ namespace IFFSpace
 	}
 
 
+	// Take the chunk's data from a byte range of a file when saving,
+	// instead of from memory. Nothing is read until then.
+	// The range holds the data uncompressed; compressed chunk types
+	// are compressed while saving.
+	void Chunk::SetSource(string file, uint64_t offset, uint64_t length)
+	{
+		Clear();
+		srcfile = file;
+		srcoffset = offset;
+		srcstored = false;
+		size = length;
+	}
+
+
+	// Take the chunk's identifier and data from a scanned chunk in another
+	// IFF when saving. The data is copied exactly as stored, so compressed
+	// chunks aren't recompressed, and containers are copied whole.
+	// Returns false if the chunk isn't in the source IFF's chunk table.
+	bool Chunk::SetSource(IFF *iff, Chunk *c)
+	{
+		auto table = iff->GetTable();
+		auto it = lower_bound(table->offsets.begin(), table->offsets.end(), c->GetOffset());
+		if(it == table->offsets.end() || *it != c->GetOffset()) return false;
+
+		auto index = (size_t)(it - table->offsets.begin());
+		Clear();
+		id = table->ids[index];
+		srcfile = iff->GetFilename();
+		srcoffset = table->offsets[index];
+		srcstored = true;
+		size = table->sizes[index];
+		return true;
+	}
+
+
+	bool Chunk::HasSource()
+	{
+		return srcfile.size() > 0;
+	}
+
+
+	// Say where the chunk's data is in the file being read, for
+	// chunks made from a chunk table rather than by ReadHeader().
+	void Chunk::SetStored(uint64_t offset, uint64_t length)
+	{
+		pos = offset;
+		size = length;
+		storedsize = length;
+	}
+
+
+	// Add an existing chunk as the last sub-chunk.
+	// The chunk is now responsible for deleting it.
+	void Chunk::AppendChunk(Chunk *c)
+	{
+		chunks.push_back(c);
+	}
+
+
 	// Add an empty sub-chunk
 	Chunk *Chunk::AddChunk(uint64_t identifier)
 	{
@@ -221,8 +533,8 @@ namespace IFFSpace
 		// it be recalculated next time it's needed.
 		size = 0;
 		// Destroy data
-		if(data) delete data;
-		auto c = new Chunk(identifier, containers);
+		Clear();
+		auto c = new Chunk(identifier, containers, dictionaries);
 		if(c)
 		{
 			c->SetData(d, s);
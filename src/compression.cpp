@@ -5,47 +5,263 @@
 //  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
 //
 
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 #include "iff.h"
-#include "zlib.h"
+#include "pool.h"
+#include "writer.h"
 
 namespace IFFSpace
 {
 	using namespace std;
 
+	// Prime a deflate stream with the shared dictionary, if a chunk
+	// of this size should use it.
+	static bool SetDictionary(z_stream *z, DictionarySet *dictionaries, uint64_t size)
+	{
+		auto dict = dictionaries ? dictionaries->GetActive(size) : nullptr;
+		if(!dict) return true;
+
+		return deflateSetDictionary(z, (const Bytef *)dict->data(), (uInt)dict->size()) == Z_OK;
+	}
+
+
+	// Write the chunk's data compressed with zlib.
+	// The header has already been written with the uncompressed size,
+	// so it's patched with the compressed size afterwards.
+	// The chunk's own size stays the uncompressed size of its data.
 	bool Chunk::WriteDataZlib(fstream *f)
 	{
-		#define BUFSIZE 128 * 1024
-		char buf[BUFSIZE];
-		uint64_t realsize = size;	// Uncompressed size
+		PooledDeflate pz;
+		PooledBuffer buf;
+		auto z = pz.Get();
+		if(!pz.OK() || !SetDictionary(z, dictionaries, size)) return false;
+
 		pos = (uint64_t)f->tellp();
 		// First uint64 of the data is the uncompressed size (little endian).
-		size = 8;
 		f->write((const char *)&size, 8);
+		uint64_t packed = 8;
 
-		z_stream z;
-		z.zalloc = 0;
-		z.zfree = 0;
-		if(deflateInit(&z, Z_BEST_COMPRESSION) != Z_OK) return false;
-		z.next_in = (unsigned char *)data;
-		z.avail_in = (uint)realsize;
-		auto flush = Z_NO_FLUSH;
+		// Feed zlib at most IFF_ZLIB_MAXCHUNK at a time.
+		auto in = data;
+		uint64_t left = size;
+		int ret;
 		do
 		{
-			z.next_out = (unsigned char *)&buf;
-			z.avail_out = BUFSIZE;
-			if(z.avail_in == 0) flush = Z_FINISH;
-			if(deflate(&z, flush) == Z_STREAM_ERROR) return false;
-
-			f->write(buf, (streamsize)z.total_out);
-			size += z.total_out;
-		} while(flush != Z_FINISH);
-		deflateEnd(&z);
+			if(z->avail_in == 0 && left)
+			{
+				auto n = min(left, (uint64_t)IFF_ZLIB_MAXCHUNK);
+				z->next_in = (unsigned char *)in;
+				z->avail_in = (uInt)n;
+				in += n;
+				left -= n;
+			}
+			z->next_out = (unsigned char *)buf.Get();
+			z->avail_out = (uInt)buf.Size();
+			ret = deflate(z, left ? Z_NO_FLUSH : Z_FINISH);
+			if(ret == Z_STREAM_ERROR) return false;
+
+			auto have = buf.Size() - z->avail_out;
+			f->write(buf.Get(), (streamsize)have);
+			packed += have;
+		} while(ret != Z_STREAM_END);
+		// Rewind to the header and write the compressed size.
+		f->seekp((off_t)pos - 8, ios::beg);
+		f->write((char *)&packed, 8);
+		f->seekp((off_t)(pos + packed), ios::beg);
+		storedsize = packed;
+		return f->good();
+	}
+
+
+	// Compress the chunk's source range into the file, reading it
+	// through a bounded buffer. The header is patched as in WriteDataZlib().
+	bool Chunk::WriteDataSourceZlib(fstream *f)
+	{
+		PooledDeflate pz;
+		PooledBuffer inbuf;
+		PooledBuffer outbuf;
+		auto z = pz.Get();
+		if(!pz.OK() || !SetDictionary(z, dictionaries, size)) return false;
+
+		int in = open(srcfile.c_str(), O_RDONLY);
+		if(in < 0) return false;
+
+		pos = (uint64_t)f->tellp();
+		f->write((const char *)&size, 8);
+		uint64_t packed = 8;
+		uint64_t done = 0;
+		int ret = Z_OK;
+		while(ret != Z_STREAM_END)
+		{
+			auto flush = Z_FINISH;
+			if(done < size)
+			{
+				auto n = pread(in, inbuf.Get(), (size_t)min(size - done, inbuf.Size()), (off_t)(srcoffset + done));
+				if(n <= 0) break;
+
+				done += (uint64_t)n;
+				z->next_in = (unsigned char *)inbuf.Get();
+				z->avail_in = (uInt)n;
+				if(done < size) flush = Z_NO_FLUSH;
+			}
+			do
+			{
+				z->next_out = (unsigned char *)outbuf.Get();
+				z->avail_out = (uInt)outbuf.Size();
+				ret = deflate(z, flush);
+				auto have = outbuf.Size() - z->avail_out;
+				f->write(outbuf.Get(), (streamsize)have);
+				packed += have;
+			} while(z->avail_out == 0);
+		}
+		close(in);
+		if(ret != Z_STREAM_END) return false;
+
 		// Rewind to the header and write the compressed size.
 		f->seekp((off_t)pos - 8, ios::beg);
-		f->write((char *)&size, 8);
-		f->write((char *)&realsize, 8);
-		f->seekp((off_t)pos, ios::beg);
-		f->seekp((off_t)size, ios::cur);
+		f->write((char *)&packed, 8);
+		f->seekp((off_t)(pos + packed), ios::beg);
+		storedsize = packed;
+		return f->good();
+	}
+
+
+	// Compress the chunk's data, or its source range, into p as it
+	// would be stored in the file: uncompressed size, then the zlib stream.
+	// Used to learn a compressed chunk's stored size before saving.
+	bool Chunk::PackZlib(PackedMap *packed, PackedChunk *p)
+	{
+		PooledDeflate pz;
+		PooledBuffer inbuf;
+		PooledBuffer outbuf;
+		auto z = pz.Get();
+		if(!pz.OK() || !SetDictionary(z, dictionaries, size)) return false;
+
+		int in = -1;
+		if(HasSource())
+		{
+			in = open(srcfile.c_str(), O_RDONLY);
+			if(in < 0) return false;
+		} else if(size && !data) {
+			return false;
+		}
+
+		bool ok = packed->Append(p, &size, 8);
+		uint64_t done = 0;
+		int ret = Z_OK;
+		while(ok && ret != Z_STREAM_END)
+		{
+			auto flush = Z_FINISH;
+			if(done < size)
+			{
+				uint64_t n;
+				if(in >= 0)
+				{
+					auto got = pread(in, inbuf.Get(), (size_t)min(size - done, inbuf.Size()), (off_t)(srcoffset + done));
+					if(got <= 0) break;
+
+					n = (uint64_t)got;
+					z->next_in = (unsigned char *)inbuf.Get();
+				} else {
+					n = min(size - done, (uint64_t)IFF_ZLIB_MAXCHUNK);
+					z->next_in = (unsigned char *)data + done;
+				}
+				done += n;
+				z->avail_in = (uInt)n;
+				if(done < size) flush = Z_NO_FLUSH;
+			}
+			do
+			{
+				z->next_out = (unsigned char *)outbuf.Get();
+				z->avail_out = (uInt)outbuf.Size();
+				ret = deflate(z, flush);
+				ok = packed->Append(p, outbuf.Get(), outbuf.Size() - z->avail_out);
+			} while(ok && z->avail_out == 0);
+		}
+		if(in >= 0) close(in);
+		return ok && ret == Z_STREAM_END;
+	}
+
+
+	// Read and decompress the chunk's data.
+	// Afterwards the size is the uncompressed size.
+	bool Chunk::ReadDataZlib(fstream *f)
+	{
+		if(size < 8) return false;
+
+		auto stored = new char[size];
+		if(!stored) return false;
+
+		f->seekg((off_t)pos, ios::beg);
+		f->read(stored, (streamsize)size);
+		bool ok = f->good() && UnpackZlib(stored, size);
+		delete[] stored;
+		return ok;
+	}
+
+
+	// Decompress len bytes of data as stored in the file (uncompressed
+	// size followed by the zlib stream) into the chunk's data.
+	bool Chunk::UnpackZlib(const char *stored, uint64_t len)
+	{
+		if(len < 8) return false;
+
+		uint64_t realsize;
+		memcpy(&realsize, stored, 8);
+		PooledInflate pz;
+		auto z = pz.Get();
+		if(!pz.OK()) return false;
+
+		auto out = new char[realsize];
+		if(!out) return false;
+
+		// Both sides go to zlib at most IFF_ZLIB_MAXCHUNK at a time.
+		auto in = stored + 8;
+		uint64_t inleft = len - 8;
+		auto next = out;
+		uint64_t outleft = realsize;
+		// Zlib wants an output pointer even when there's nothing to output.
+		z->next_out = (unsigned char *)out;
+		int ret;
+		do
+		{
+			if(z->avail_in == 0 && inleft)
+			{
+				auto n = min(inleft, (uint64_t)IFF_ZLIB_MAXCHUNK);
+				z->next_in = (unsigned char *)in;
+				z->avail_in = (uInt)n;
+				in += n;
+				inleft -= n;
+			}
+			if(z->avail_out == 0 && outleft)
+			{
+				auto n = min(outleft, (uint64_t)IFF_ZLIB_MAXCHUNK);
+				z->next_out = (unsigned char *)next;
+				z->avail_out = (uInt)n;
+				next += n;
+				outleft -= n;
+			}
+			ret = inflate(z, Z_NO_FLUSH);
+			if(ret == Z_NEED_DICT)
+			{
+				// Compressed with a shared dictionary from a ZDICT chunk.
+				auto dict = dictionaries ? dictionaries->Find((uint32_t)z->adler) : nullptr;
+				if(dict && inflateSetDictionary(z, (const Bytef *)dict->data(), (uInt)dict->size()) == Z_OK) ret = Z_OK;
+			}
+			// No progress possible: truncated input or too much output.
+			if(ret == Z_BUF_ERROR && ((!z->avail_in && !inleft) || (!z->avail_out && !outleft))) break;
+		} while(ret == Z_OK || ret == Z_BUF_ERROR);
+
+		// Anything left in the output means the data was short.
+		if(ret != Z_STREAM_END || z->avail_out || outleft)
+		{
+			delete[] out;
+			return false;
+		}
+
+		AdoptData(out, realsize);
 		return true;
 	}
 } // End namespace IFFSpace
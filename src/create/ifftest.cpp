@@ -5,7 +5,11 @@
 //  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
 //
 
+#include <cstring>
 #include "iff.h"
+#include "stream.h"
+#include "async.h"
+#include "text.h"
 #include "getopt.h"
 
 #define PROGRAM "ifftest"
@@ -18,6 +22,56 @@ using namespace IFFSpace;
 
 void usage();
 int test();
+int texttest();
+int dicttest();
+int atomictest();
+int viewtest();
+int streamtest();
+int asynctest();
+
+// Counts chunks seen by the stream reader.
+class CountHandler : public StreamHandler
+{
+public:
+	size_t count = 0;
+
+	bool Want(uint64_t, uint64_t, uint32_t) { count++; return true; }
+	bool EnterContainer(uint64_t, uint64_t, uint32_t) { count++; return true; }
+	bool Data(uint64_t, const char *, uint64_t, uint64_t) { return true; }
+};
+
+
+// Collects the data of every wanted chunk, in order, and skips
+// the chunks with one identifier.
+class CollectHandler : public StreamHandler
+{
+public:
+	uint64_t skip;
+	vector<string> got;
+	bool inorder = true;
+
+	CollectHandler(uint64_t unwanted) { skip = unwanted; }
+	bool Want(uint64_t id, uint64_t, uint32_t)
+	{
+		if(id == skip) return false;
+		got.push_back("");
+		return true;
+	}
+	bool Data(uint64_t, const char *data, uint64_t len, uint64_t offset)
+	{
+		inorder &= offset == got.back().size();
+		got.back().append(data, len);
+		return true;
+	}
+};
+
+// Whole contents of a file.
+static string slurp(const string &name)
+{
+	ifstream in(name, ios::binary);
+	return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
 
 void usage()
 {
@@ -65,10 +119,47 @@ int test()
 	auto aSize = iff->GetFileSize();
 	auto aChunks = iff->NumChunks();
 	cout << "Opened file with " << aChunks << " chunks, totalling " << aSize <<" bytes.\n";
+	auto tSize = iff->GetTable()->GetFileSize();
+	auto tChunks = iff->GetTable()->NumChunks();
+	cout << "Chunk table has " << tChunks << " entries, totalling " << tSize << " bytes.\n";
 	iff->LoadAllChunks();
+	// Sizes follow changes made below the top level.
+	s = "Added after loading.";
+	iff->GetChunk(2)->AddChunk(IFF_UTF8, (char *)s.c_str(), s.size());
+	bool grown = iff->GetFileSize() == eSize + 16 + s.size();
+
+	// Files opened for reading can't be saved over.
+	bool refused = !iff->SaveSequential() && !iff->Save() && iff->GetTable()->GetFileSize() == eSize;
+
+	// Copy it with both kinds of save; it should come out the same.
+	// Conversions don't touch copied chunks.
+	string copyname = string(optarg) + ".copy";
+	bool resaved = true;
+	for(bool sequential : { false, true })
+	{
+		auto copy = new IFF(copyname, true);
+		copy->RegisterContainer(IFF_ARCHIVE);
+		copy->ConvertOnSave(IFF_UTF8, IFF_UTF16);
+		for(size_t i = 0; i < iff->NumChunks(); i++)
+			copy->AddChunk(IFF_UTF8)->SetSource(iff, iff->GetChunk(i));
+		resaved &= sequential ? copy->SaveSequential() : copy->Save();
+		delete copy;
+		resaved &= slurp(optarg) == slurp(copyname);
+	}
 	delete iff;
+	remove(copyname.c_str());
 
-	if((eSize != aSize) || (eChunks != aChunks))
+	// Single pass over the file, without seeking
+	ifstream in(optarg, ios::binary);
+	StreamSource src(&in);
+	StreamReader sr(&src);
+	sr.RegisterContainer(IFF_ARCHIVE);
+	CountHandler counter;
+	bool streamed = sr.Run(&counter);
+	cout << "Streamed " << counter.count << " chunks.\n";
+
+	if((eSize != aSize) || (eChunks != aChunks) || (eSize != tSize) || (tChunks != eChunks + 4)
+		|| !grown || !refused || !resaved || !streamed || (counter.count != tChunks) || (sr.GetSize() + 16 != eSize))
 	{
 		cout << "IFF inconsistency!\n";
 		return 2;
@@ -78,6 +169,387 @@ int test()
 }
 
 
+// Stream a file with compressed chunks, one larger than the reader's
+// buffers, and skip the NAME chunks on the way.
+int streamtest()
+{
+	string name = string(optarg) + ".stream";
+	string big, small = "A small compressed chunk.", plain = "A plain chunk.", label = "Skipped.";
+	for(int i = 0; i < 20000; i++) big += "Line " + to_string(i) + " of a long compressed chunk.\n";
+
+	auto iff = new IFF(name, true);
+	iff->AddChunk(IFF_NAME, (char *)label.data(), label.size());
+	iff->AddChunk(IFF_COMP_UTF8, (char *)big.data(), big.size());
+	auto c = iff->AddChunk(IFF_FOLDER);
+	c->AddChunk(IFF_NAME, (char *)label.data(), label.size());
+	c->AddChunk(IFF_COMP_UTF8, (char *)small.data(), small.size());
+	c->AddChunk(IFF_UTF8, (char *)plain.data(), plain.size());
+	bool saved = iff->Save();
+	delete iff;
+	auto total = slurp(name).size();
+
+	ifstream in(name, ios::binary);
+	StreamSource src(&in);
+	StreamReader sr(&src);
+	CollectHandler collect(IFF_NAME);
+	bool streamed = sr.Run(&collect);
+	in.close();
+	remove(name.c_str());
+
+	const vector<string> expected = { big, small, plain };
+	if(!saved || !streamed || !collect.inorder || collect.got != expected || sr.GetConsumed() != total)
+	{
+		cout << "Streaming failed!\n";
+		return 2;
+	}
+	cout << "Streaming looks OK.\n";
+	return 0;
+}
+
+
+// Load plain, compressed and nested chunks asynchronously, with few
+// reads in flight so the queue has to be refilled, and check the bytes.
+int asynctest()
+{
+	string name = string(optarg) + ".async";
+	vector<string> texts;
+	for(int i = 0; i < 300; i++)
+		texts.push_back(string(1 + i * 37 % 5000, 'a' + i % 26) + "Chunk " + to_string(i) + ".");
+
+	auto iff = new IFF(name, true);
+	auto folder = iff->AddChunk(IFF_FOLDER);
+	for(size_t i = 0; i < texts.size(); i++)
+	{
+		auto id = i % 3 ? IFF_UTF8 : IFF_COMP_UTF8;
+		auto &t = texts[i];
+		if(i % 2)
+			folder->AddChunk(id, (char *)t.data(), t.size());
+		else
+			iff->AddChunk(id, (char *)t.data(), t.size());
+	}
+	bool saved = iff->Save();
+
+	// Same order as added: odd chunks in the folder, the rest after it.
+	vector<Chunk *> chunks;
+	iff->Reopen();
+	folder = iff->GetChunk(0);
+	for(size_t i = 0; i < texts.size(); i++)
+		chunks.push_back(i % 2 ? folder->GetChunk(i / 2) : iff->GetChunk(1 + i / 2));
+
+	bool loaded;
+	{
+		AsyncLoader loader(iff, 4);
+		auto one = loader.Load(chunks[0]);
+		loader.Submit();
+		loaded = one.get();
+		// The chunk already loaded isn't read again.
+		auto all = loader.LoadAll(iff);
+		loader.Submit();
+		loaded &= all.get() && loader.GetCompleted() == texts.size();
+	}
+	for(size_t i = 0; loaded && i < texts.size(); i++)
+		loaded = string(chunks[i]->GetData(), chunks[i]->GetSize()) == texts[i];
+	delete iff;
+	remove(name.c_str());
+
+	if(!saved || !loaded)
+	{
+		cout << "Asynchronous loading failed!\n";
+		return 2;
+	}
+	cout << "Asynchronous loading looks OK.\n";
+	return 0;
+}
+
+
+static size_t countzdict(IFF *iff)
+{
+	size_t n = 0;
+	for(size_t i = 0; i < iff->NumChunks(); i++)
+		if(iff->GetChunk(i)->GetID() == IFF_ZDICT) n++;
+	return n;
+}
+
+
+// Train a dictionary on many small compressed chunks, save, reopen and
+// load them back. Training again must replace the saved dictionary.
+int dicttest()
+{
+	string name = string(optarg) + ".dict";
+	vector<string> texts;
+	for(int i = 0; i < 200; i++)
+		texts.push_back("Record " + to_string(i) + ": the quick brown fox jumps over the lazy dog, "
+			"and the lazy dog sleeps on regardless of record " + to_string(i * 7) + ".");
+
+	auto iff = new IFF(name, true);
+	for(auto &t : texts) iff->AddChunk(IFF_COMP_UTF8, (char *)t.data(), t.size());
+	bool trained = iff->TrainDictionary();
+	bool saved = iff->Save();
+	auto dictid = iff->GetDictionaries()->active;
+
+	iff->Reopen();
+	bool loaded = iff->LoadAllChunks();
+	int failed = !trained || !saved || !loaded || !iff->OK() || iff->NumChunks() != texts.size() + 1;
+	if(!failed)
+	{
+		for(size_t i = 0; i < texts.size(); i++)
+		{
+			auto c = iff->GetChunk(i + 1);
+			if(c->GetSize() != texts[i].size() || memcmp(c->GetData(), texts[i].data(), c->GetSize()) != 0)
+				failed++;
+		}
+	}
+	if(iff->GetDictionaries()->active != dictid || iff->GetTable()->Count(IFF_ZDICT) != 1) failed++;
+
+	if(!iff->TrainDictionary() || countzdict(iff) != 1) failed++;
+	delete iff;
+	remove(name.c_str());
+
+	if(failed)
+	{
+		cout << "Dictionary round trip failed!\n";
+		return 2;
+	}
+	cout << "Dictionary round trip looks OK.\n";
+	return 0;
+}
+
+
+// A failed atomic save must leave the old file alone, and a save
+// synced in the background must be complete once WaitForSave() returns.
+int atomictest()
+{
+	string name = string(optarg) + ".atomic";
+	string s = "The original contents.";
+	auto iff = new IFF(name, true);
+	iff->AddChunk(IFF_UTF8, (char *)s.data(), s.size());
+	bool saved = iff->Save();
+	delete iff;
+	auto before = slurp(name);
+
+	iff = new IFF(name, true, true);
+	iff->AddChunk(IFF_UTF8, (char *)s.data(), s.size());
+	iff->AddChunk(IFF_UTF8)->SetSource(name + ".missing", 0, 100);
+	bool failed = iff->Save();
+	delete iff;
+	bool kept = slurp(name) == before;
+
+	s = "Replaced in the background.";
+	iff = new IFF(name, true, true);
+	iff->SyncInBackground(true);
+	for(int i = 0; i < 100; i++) iff->AddChunk(IFF_UTF8, (char *)s.data(), s.size());
+	bool synced = iff->Save() && iff->WaitForSave();
+	iff->Reopen();
+	bool loaded = iff->LoadAllChunks() && iff->NumChunks() == 100;
+	for(size_t i = 0; loaded && i < iff->NumChunks(); i++)
+		loaded = string(iff->GetChunk(i)->GetData(), iff->GetChunk(i)->GetSize()) == s;
+	delete iff;
+	remove(name.c_str());
+
+	if(!saved || failed || !kept || !synced || !loaded)
+	{
+		cout << "Atomic saving failed!\n";
+		return 2;
+	}
+	cout << "Atomic saving looks OK.\n";
+	return 0;
+}
+
+
+// Typed views over chunk data: whole items only, suitably aligned,
+// and of the right type if one is asked for.
+int viewtest()
+{
+	struct alignas(64) Block { float v[16]; };
+	ContainerMap containers;
+	int failed = 0;
+
+	const float values[] = { 1.5f, -2.0f, 3.25f };
+	Chunk c(IFF_VALUE, &containers);
+	c.SetData((char *)values, sizeof(values));
+	ChunkView<float> floats(&c);
+	if(!floats.OK() || floats.Size() != 3 || floats[2] != 3.25f || floats.Span().size() != 3) failed++;
+	if(ChunkView<float>(&c, IFF_PROP).OK() || !ChunkView<float>(&c, IFF_VALUE).OK()) failed++;
+
+	bool thrown = false;
+	try
+	{
+		floats.at(3);
+	} catch(out_of_range &) {
+		thrown = true;
+	}
+	if(!thrown) failed++;
+
+	// Sizes that aren't a whole number of items.
+	c.SetData((char *)values, sizeof(values) - 2);
+	if(ChunkView<float>(&c).OK() || ChunkView<char>(&c).Size() != sizeof(values) - 2) failed++;
+
+	// Data only sometimes lands on a 64-byte boundary, depending on the
+	// allocator; the view must follow it either way.
+	char raw[sizeof(Block)] = {};
+	vector<Chunk *> blocks;
+	for(int i = 0; i < 16; i++)
+	{
+		auto b = new Chunk(IFF_VALUE, &containers);
+		b->SetData(raw, sizeof(raw));
+		bool aligned = (uintptr_t)b->GetData() % alignof(Block) == 0;
+		if(ChunkView<Block>(b).OK() != aligned) failed++;
+		blocks.push_back(b);
+	}
+	for(auto b : blocks) delete b;
+
+	if(failed)
+	{
+		cout << failed << " chunk view checks failed!\n";
+		return 2;
+	}
+	cout << "Chunk views look OK.\n";
+	return 0;
+}
+
+
+// Text in every encoding, with one-, two-, three- and four-byte
+// UTF-8 sequences (the last being surrogate pairs in UTF-16).
+struct Sample
+{
+	uint64_t		id;
+	string			data;
+};
+
+static vector<Sample> samples(int repeat)
+{
+	string u8, u16, u32;
+	const char s8[] = "Plain text, \xc3\xa6\xc3\xb8\xc3\xa5, \xe2\x82\xac \xe2\x9c\x93, \xf0\x9f\x98\x80 \xf0\x9d\x84\x9e end.";
+	const char16_t s16[] = u"Plain text, \u00e6\u00f8\u00e5, \u20ac \u2713, \U0001f600 \U0001d11e end.";
+	const char32_t s32[] = U"Plain text, \u00e6\u00f8\u00e5, \u20ac \u2713, \U0001f600 \U0001d11e end.";
+	for(int i = 0; i < repeat; i++)
+	{
+		u8.append(s8, sizeof(s8) - 1);
+		u16.append((const char *)s16, sizeof(s16) - 2);
+		u32.append((const char *)s32, sizeof(s32) - 4);
+	}
+	return {
+		{IFF_UTF8, u8}, {IFF_UTF16, u16}, {IFF_UTF32, u32},
+		{IFF_COMP_UTF8, u8}, {IFF_COMP_UTF16, u16}, {IFF_COMP_UTF32, u32},
+	};
+}
+
+
+static bool transcodes(uint64_t from, const string &in, uint64_t to, const string &out)
+{
+	char *dst;
+	uint64_t size;
+	if(!TranscodeText(from, in.data(), in.size(), to, &dst, &size)) return false;
+
+	bool same = size == out.size() && memcmp(dst, out.data(), size) == 0;
+	delete[] dst;
+	return same;
+}
+
+
+static bool rejects(uint64_t from, const string &in)
+{
+	const uint64_t types[] = { IFF_ASCII, IFF_UTF8, IFF_UTF16, IFF_UTF32 };
+	if(ValidateText(from, in.data(), in.size())) return false;
+
+	for(auto to : types)
+	{
+		char *dst;
+		uint64_t size;
+		if(TranscodeText(from, in.data(), in.size(), to, &dst, &size))
+		{
+			delete[] dst;
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// Convert between every pair of text types, short and long enough for
+// the vector paths, and make sure invalid text is always refused.
+int texttest()
+{
+	int failed = 0;
+	for(int repeat : { 1, 100 })
+	{
+		auto all = samples(repeat);
+		for(auto &a : all)
+			for(auto &b : all)
+				if(!transcodes(a.id, a.data, b.id, b.data)) failed++;
+
+		// Only ASCII survives narrowing to ASCII.
+		string ascii(repeat * 40, 'x');
+		for(auto &a : all)
+		{
+			char *dst;
+			uint64_t size;
+			if(TranscodeText(a.id, a.data.data(), a.data.size(), IFF_ASCII, &dst, &size))
+			{
+				delete[] dst;
+				failed++;
+			}
+			// Widening ASCII pads each character with zero bytes.
+			string wide;
+			for(auto c : ascii)
+			{
+				wide += c;
+				wide.append(GetTextUnitSize(a.id) - 1, 0);
+			}
+			if(!transcodes(IFF_ASCII, ascii, a.id, wide)) failed++;
+		}
+	}
+
+	// Overlong forms, encoded surrogates, values above U+10FFFF and
+	// truncated sequences, each after enough ASCII to reach the vector code.
+	string lead(70, 'a');
+	const char *bad8[] = { "\xc0\xaf", "\xe0\x80\xaf", "\xf0\x80\x80\xaf", "\xed\xa0\x80",
+		"\xf4\x90\x80\x80", "\xf8\x88\x80\x80\x80", "\xe2\x82", "\x80" };
+	for(auto b : bad8)
+	{
+		if(!rejects(IFF_UTF8, string(b))) failed++;
+		if(!rejects(IFF_UTF8, lead + b + "z")) failed++;
+	}
+
+	// Lone, reversed and truncated surrogates.
+	const vector<u16string> bad16 = { {0xd800, 'a'}, {0xdc00}, {'a', 0xdc00, 0xd800, 'b'}, {'a', 'b', 0xd83d} };
+	for(auto &b : bad16)
+	{
+		if(!rejects(IFF_UTF16, string((const char *)b.data(), b.size() * 2))) failed++;
+		auto padded = u16string(lead.begin(), lead.end()) + b;
+		if(!rejects(IFF_UTF16, string((const char *)padded.data(), padded.size() * 2))) failed++;
+	}
+
+	const vector<u32string> bad32 = { U"a\x110000", {0xd800}, {0xdfff, 'a'}, {0xffffffff} };
+	for(auto &b : bad32)
+		if(!rejects(IFF_UTF32, string((const char *)b.data(), b.size() * 4))) failed++;
+
+	// Odd sizes can't be whole UTF-16 or UTF-32 units.
+	if(!rejects(IFF_UTF16, "abc") || !rejects(IFF_UTF32, "abcdef")) failed++;
+
+	// Saves fail if a conversion does, whichever way they're written.
+	string name = string(optarg) + ".conv";
+	string text = "Not ASCII: \xc3\xa6\xc3\xb8\xc3\xa5";
+	for(bool sequential : { false, true })
+	{
+		auto iff = new IFF(name, true);
+		iff->AddChunk(IFF_UTF8, (char *)text.data(), text.size());
+		iff->ConvertOnSave(IFF_UTF8, IFF_ASCII);
+		if(sequential ? iff->SaveSequential() : iff->Save()) failed++;
+		delete iff;
+	}
+	remove(name.c_str());
+
+	if(failed)
+	{
+		cout << failed << " text conversion checks failed!\n";
+		return 2;
+	}
+	cout << "Text conversion looks OK.\n";
+	return 0;
+}
+
+
 int main(int argc, char * const *argv)
 {
 	static struct option longopts[] = {
@@ -96,8 +568,17 @@ int main(int argc, char * const *argv)
 				return 0;
 				break;
 			case 't':
-				return test();
+			{
+				int ret = test();
+				if(ret == 0) ret = texttest();
+				if(ret == 0) ret = dicttest();
+				if(ret == 0) ret = atomictest();
+				if(ret == 0) ret = viewtest();
+				if(ret == 0) ret = streamtest();
+				if(ret == 0) ret = asynctest();
+				return ret;
 				break;
+			}
 			case 0:
 				
 				break;
@@ -0,0 +1,154 @@
+//
+//  dictionary.cpp
+//  Shared compression dictionaries.
+//
+//  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include "iff.h"
+#include "zlib.h"
+
+namespace IFFSpace
+{
+	// Substring length used to find common content when training,
+	// and the length of the pieces copied into the dictionary.
+	#define DICT_GRAM 8
+	#define DICT_SEGMENT 64
+	// Stop sampling after this many bytes per byte of dictionary.
+	#define DICT_SAMPLE_RATIO 128
+
+#pragma mark DictionarySet
+	// Add a dictionary and return its ID.
+	uint32_t DictionarySet::Add(const char *d, uint64_t s)
+	{
+		auto dictid = (uint32_t)adler32(adler32(0, nullptr, 0), (const Bytef *)d, (uInt)s);
+		dicts[dictid] = string(d, s);
+		return dictid;
+	}
+
+
+	// Find a dictionary by ID, as reported by inflate().
+	const string *DictionarySet::Find(uint32_t dictid)
+	{
+		auto it = dicts.find(dictid);
+		if(it == dicts.end()) return nullptr;
+
+		return &it->second;
+	}
+
+
+	// The dictionary to compress a chunk of the given size with, if any.
+	const string *DictionarySet::GetActive(uint64_t size)
+	{
+		if(!active || size > threshold) return nullptr;
+
+		return Find(active);
+	}
+
+
+	void DictionarySet::Clear()
+	{
+		dicts.clear();
+		active = 0;
+		threshold = 0;
+	}
+
+
+#pragma mark Training
+	// Build a dictionary of up to maxsize bytes from sample data.
+	//
+	// Every 8-byte substring is counted once per sample it appears in.
+	// Samples are cut into 64-byte segments, scored by how common their
+	// substrings are, and the best segments are picked greedily, with
+	// the substrings of each pick no longer counting towards the rest.
+	// Zlib finds strings near the end of the dictionary most cheaply,
+	// so the best segments go last.
+	string DictionarySet::Train(vector<pair<const char *, uint64_t>> &samples, size_t maxsize)
+	{
+		// Spread the sample budget evenly over the input.
+		uint64_t total = 0;
+		for(auto &s : samples) total += s.second;
+		uint64_t budget = (uint64_t)maxsize * DICT_SAMPLE_RATIO;
+		size_t step = total > budget ? (size_t)(total / budget) + 1 : 1;
+
+		vector<pair<const char *, uint64_t>> used;
+		for(size_t i = 0; i < samples.size(); i += step) used.push_back(samples[i]);
+		if(used.size() < 2) return "";
+
+		unordered_map<uint64_t, uint32_t> freq;
+		unordered_set<uint64_t> seen;
+		for(auto &s : used)
+		{
+			seen.clear();
+			for(uint64_t i = 0; i + DICT_GRAM <= s.second; i++)
+			{
+				uint64_t gram;
+				memcpy(&gram, s.first + i, DICT_GRAM);
+				if(seen.insert(gram).second) freq[gram]++;
+			}
+		}
+
+		auto score = [&freq](const char *p, uint64_t len)
+		{
+			uint64_t total = 0;
+			for(uint64_t i = 0; i + DICT_GRAM <= len; i++)
+			{
+				uint64_t gram;
+				memcpy(&gram, p + i, DICT_GRAM);
+				auto it = freq.find(gram);
+				// Only content shared between samples is worth keeping.
+				if(it != freq.end() && it->second > 1) total += it->second;
+			}
+			return total;
+		};
+
+		struct Segment
+		{
+			const char	*p;
+			uint64_t	len;
+			uint64_t	score;
+		};
+		vector<Segment> segments;
+		for(auto &s : used)
+		{
+			for(uint64_t i = 0; i < s.second; i += DICT_SEGMENT)
+			{
+				auto len = min((uint64_t)DICT_SEGMENT, s.second - i);
+				if(len < DICT_GRAM) continue;
+
+				auto sc = score(s.first + i, len);
+				if(sc) segments.push_back({s.first + i, len, sc});
+			}
+		}
+		sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b){ return a.score > b.score; });
+
+		vector<Segment> picked;
+		size_t size = 0;
+		for(auto &seg : segments)
+		{
+			if(size + seg.len > maxsize) continue;
+
+			// Earlier picks may already cover this segment.
+			if(score(seg.p, seg.len) * 2 < seg.score) continue;
+
+			picked.push_back(seg);
+			size += seg.len;
+			for(uint64_t i = 0; i + DICT_GRAM <= seg.len; i++)
+			{
+				uint64_t gram;
+				memcpy(&gram, seg.p + i, DICT_GRAM);
+				freq.erase(gram);
+			}
+			if(size + DICT_GRAM > maxsize) break;
+		}
+
+		string dict;
+		dict.reserve(size);
+		for(auto it = picked.rbegin(); it != picked.rend(); it++) dict.append(it->p, it->len);
+		return dict;
+	}
+} // End namespace IFFSpace
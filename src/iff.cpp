@@ -6,20 +6,32 @@
 //
 
 #include <iostream>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "iff.h"
+#include "text.h"
+#include "writer.h"
 
 namespace IFFSpace
 {
 #pragma mark IFF constructor
-	// Create IFF for reading or writing
-	IFF::IFF(string name, bool write)
+	// Create IFF for reading or writing.
+	// With atomic, an existing file is left alone until the next save.
+	IFF::IFF(string name, bool write, bool atomic)
 	{
 		size = 0;
+		lazy = false;
+		writable = false;
 		filename.assign(name);
-		Reopen(write);
+		this->atomic = false;
+		background = false;
+		syncok = true;
 
-		// Set up known container chunk identifiers
+		// Set up known container chunk identifiers before scanning
 		RegisterContainer(IFF_FOLDER);
+		Reopen(write, atomic);
 	}
 
 
@@ -30,6 +42,12 @@ namespace IFFSpace
 	}
 
 
+	string IFF::GetFilename()
+	{
+		return filename;
+	}
+
+
 	// Get the size of the entire file
 	uint64_t IFF::GetSize()
 	{
@@ -40,7 +58,9 @@ namespace IFFSpace
 #pragma mark IFF destructor
 	IFF::~IFF()
 	{
+		WaitForSave();
 		f.close();
+		DropTemp();
 		Erase();
 	}
 
@@ -60,21 +80,32 @@ namespace IFFSpace
 			chunks.erase(chunks.begin());
 			delete c;
 		}
+		table.Clear();
+		lazy = false;
+		dictionaries.Clear();
 	}
 
 
 	// Flush, close and reopen in read or write mode.
-	bool IFF::Reopen(bool write)
+	// Writing normally truncates the file right away. With atomic,
+	// saves go to a temporary file which then replaces the target.
+	bool IFF::Reopen(bool write, bool atomic)
 	{
+		WaitForSave();
 		if(f.is_open())
 		{
 			f.flush();
 			f.close();
 		}
+		DropTemp();
 		Erase();
+		this->atomic = write && atomic;
+		writable = write;
 		auto flags = ios::binary;
-		if(write)
+		if(this->atomic)
 		{
+			OpenTemp();
+		} else if(write) {
 			// Create a new file for writing, truncate any existing file
 			flags |= ios::out | ios::trunc | ios::ate;
 			f.open(filename, flags);
@@ -135,23 +166,164 @@ namespace IFFSpace
 	}
 
 
+	// Convert text chunks of type from into type to as they are loaded,
+	// for example to store UTF-8 on disk but work with UTF-32.
+	void IFF::ConvertOnLoad(uint64_t from, uint64_t to)
+	{
+		loadconv[from] = to;
+	}
+
+
+	// Convert text chunks of type from into type to before saving.
+	// Converting to a compressed text type compresses the chunk.
+	// Chunks copied from a source are saved unconverted.
+	void IFF::ConvertOnSave(uint64_t from, uint64_t to)
+	{
+		saveconv[from] = to;
+	}
+
+
+#pragma mark Compression dictionaries
+	// Build a shared dictionary from the loaded compressed text chunks
+	// of up to threshold bytes, and use it to compress those chunks.
+	// The dictionary is saved in a ZDICT chunk at the start of the file.
+	// Returns false if there were no suitable chunks to learn from.
+	bool IFF::TrainDictionary(size_t maxsize, uint64_t threshold)
+	{
+		vector<pair<const char *, uint64_t>> samples;
+		BuildChunks();
+		vector<Chunk *> pending(chunks.begin(), chunks.end());
+		while(pending.size())
+		{
+			auto c = pending.back();
+			pending.pop_back();
+			if(c->IsContainer())
+			{
+				for(size_t i = 0; i < c->NumChunks(); i++) pending.push_back(c->GetChunk(i));
+			} else if(IsCompressedID(c->GetID()) && c->GetData() && c->GetSize() <= threshold) {
+				samples.push_back({c->GetData(), c->GetSize()});
+			}
+		}
+
+		auto dict = DictionarySet::Train(samples, maxsize);
+		if(dict.size() == 0) return false;
+
+		SetDictionary(dict.data(), dict.size(), threshold);
+		return true;
+	}
+
+
+	// Use the given dictionary for compressed chunks of up to threshold bytes.
+	// The dictionary is saved in a ZDICT chunk at the start of the file,
+	// replacing the first one already there. Older dictionaries stay in
+	// the set, so chunks compressed with them can still be loaded.
+	void IFF::SetDictionary(const char *d, uint64_t s, uint64_t threshold)
+	{
+		dictionaries.active = dictionaries.Add(d, s);
+		dictionaries.threshold = threshold;
+		BuildChunks();
+		for(auto c : chunks)
+		{
+			if(c->GetID() != IFF_ZDICT) continue;
+
+			c->SetData((char *)d, s);
+			return;
+		}
+
+		auto c = new Chunk(IFF_ZDICT, &containers, &dictionaries);
+		c->SetData((char *)d, s);
+		chunks.insert(chunks.begin(), c);
+	}
+
+
+	DictionarySet *IFF::GetDictionaries()
+	{
+		return &dictionaries;
+	}
+
+
 #pragma mark File operations
-	// Look through the file, allocate chunk stubs and return number of chunks found
+	// Look through the file and fill in the chunk table.
+	// Only the table is built here; the Chunk objects are made from it
+	// the first time they're asked for, so metadata queries on a
+	// large file need no more than the table.
 	void IFF::ScanFile()
 	{
 		if(size == 0) return;
 
-		f.seekg(16, ios::beg);
-		uint64_t pos=0;
-		// pos represents size of data without IFF header
-		while(pos < size)
+		// Containers still open, innermost last, with where they end.
+		vector<pair<uint32_t, uint64_t>> open;
+		uint64_t end = size + 16;
+		uint64_t pos = 16;
+		while(pos < end)
 		{
-			auto c = new Chunk(IFF_UTF8, &containers);
-			c->ReadHeader(&f);
-			chunks.push_back(c);
+			// Whatever follows a container's last sub-chunk starts
+			// where the container ends.
+			while(open.size() && pos >= open.back().second)
+			{
+				pos = open.back().second;
+				open.pop_back();
+			}
+			if(pos >= end) break;
+
+			uint64_t header[2];
+			f.seekg((off_t)pos, ios::beg);
+			f.read((char *)header, sizeof(header));
+			if(!f.good()) break;
+
 			pos += 16;
-			f.seekg((off_t)c->GetSize(), ios::cur);
-			pos += c->GetSize();
+			auto index = table.Add(header[0], pos, header[1], open.size() ? open.back().first : IFF_NO_PARENT);
+			if(index == IFF_NO_PARENT) break;
+
+			if(containers.find(header[0]) != containers.end())
+				open.push_back({index, pos + header[1]});
+			else
+				pos += header[1];
+		}
+		f.clear();
+		lazy = table.NumChunks() > 0;
+
+		// Shared dictionaries are small and needed to decompress other
+		// chunks, so load them right away. Saving again reuses the first.
+		for(auto i : table.Find(IFF_ZDICT))
+		{
+			if(table.parents[i] != IFF_NO_PARENT) continue;
+
+			string dict(table.sizes[i], 0);
+			f.seekg((off_t)table.offsets[i], ios::beg);
+			f.read(dict.data(), (streamsize)dict.size());
+			if(!f.good()) continue;
+
+			auto dictid = dictionaries.Add(dict.data(), dict.size());
+			if(!dictionaries.active)
+			{
+				dictionaries.active = dictid;
+				dictionaries.threshold = IFF_DICT_THRESHOLD;
+			}
+		}
+		f.clear();
+	}
+
+
+	// Make the Chunk objects for a scanned file from its chunk table.
+	// Parents always come before their sub-chunks in the table.
+	void IFF::BuildChunks()
+	{
+		if(!lazy) return;
+
+		lazy = false;
+		vector<Chunk *> made;
+		made.reserve(table.NumChunks());
+		for(size_t i = 0; i < table.NumChunks(); i++)
+		{
+			auto c = new Chunk(table.ids[i], &containers, &dictionaries);
+			c->SetStored(table.offsets[i], table.sizes[i]);
+			made.push_back(c);
+			auto parent = table.parents[i];
+			if(parent == IFF_NO_PARENT)
+				chunks.push_back(c);
+			else
+				made[parent]->AppendChunk(c);
 		}
 	}
 
@@ -161,18 +333,22 @@ namespace IFFSpace
 	// Returns true if all chunks loaded into memory.
 	bool IFF::LoadAllChunks()
 	{
+		BuildChunks();
+		bool ok = true;
 		for(auto c : chunks)
 		{
-			c->ReadData(&f);
+			ok &= c->ReadData(&f);
+			if(loadconv.size()) ok &= c->ApplyConversions(&loadconv);
 		}
-		return false;
+		return ok;
 	}
 
 
 	// Create an empty chunk with the desired identifier
 	Chunk *IFF::AddChunk(uint64_t id)
 	{
-		auto c = new Chunk(id, &containers);
+		BuildChunks();
+		auto c = new Chunk(id, &containers, &dictionaries);
 		if(c) chunks.push_back(c);
 		return c;
 	}
@@ -190,22 +366,41 @@ namespace IFFSpace
 
 	size_t IFF::NumChunks()
 	{
+		BuildChunks();
 		return chunks.size();
 	}
 
 
 	Chunk *IFF::GetChunk(size_t index)
 	{
+		BuildChunks();
 		return chunks.at(index);
 	}
 
 
+	// The flat chunk table filled in by ScanFile().
+	// It describes the file as it was scanned, and does not
+	// include chunks added since.
+	ChunkTable *IFF::GetTable()
+	{
+		return &table;
+	}
+
+
 	// Sum up the size of all chunks with data,
 	// adding header sizes to get the final filesize total.
 	// The size variable is set to the size of all the chunks with their headers.
 	// The returned size adds the 16-byte header to the calculation.
+	// A scanned file whose chunks haven't been asked for yet can't have
+	// changed, so it is summed from the chunk table instead.
 	size_t IFF::GetFileSize()
 	{
+		if(lazy)
+		{
+			size = table.GetFileSize() - 16;
+			return size+16;
+		}
+
 		size = 0;
 		for(auto c : chunks)
 		{
@@ -219,24 +414,206 @@ namespace IFFSpace
 	// Saves header and all chunks with data.
 	// Empty chunks are not saved.
 	// The size variable is recalculated along the way.
+	// Returns false if any chunk couldn't be converted or written,
+	// or if the IFF was opened for reading only.
 	bool IFF::Save()
 	{
+		if(!BeginSave()) return false;
+
 		auto h = IFF_FILEID;
 		f.write((char *)&h, 8);
 		f.write((char *)&h, 8);
-		size = 0;
+		// Chunks with external sources are copied through this.
+		int fd = open(SavePath().c_str(), O_WRONLY);
+		bool ok = true;
 		for(auto c : chunks)
 		{
+			if(saveconv.size()) ok &= c->ApplyConversions(&saveconv);
 			if(c->GetSize())
 			{
-				c->WriteHeader(&f);
-				c->WriteData(&f);
-				size += c->GetFullSize();
+				ok &= c->WriteHeader(&f);
+				ok &= c->WriteData(&f, fd);
 			}
 		}
+		if(fd >= 0) close(fd);
+		// Compressed chunks are only sized once written.
+		size = (uint64_t)f.tellp() - 16;
 		f.seekg(8, ios::beg);
 		f.write((char *)&size, sizeof(size));
 		f.flush();
-		return true;
+		return EndSave(ok && f.good());
+	}
+
+
+	// Save the IFF file in one front-to-back pass.
+	// All sizes are worked out first (compressing chunks into memory or
+	// a scratch file as needed), so the whole file can be preallocated
+	// and written in large sequential blocks, with no seeking back to
+	// patch headers.
+	// With direct, the page cache is bypassed where the filesystem
+	// supports it. Use instead of Save(), not as well as it.
+	// Chunks without data are found before the file is opened.
+	bool IFF::SaveSequential(bool direct)
+	{
+		if(!BeginSave()) return false;
+
+		PackedMap packed(SavePath());
+		vector<Chunk *> out;
+		bool ok = true;
+		size = 0;
+		for(auto c : chunks)
+		{
+			if(saveconv.size()) ok = c->ApplyConversions(&saveconv);
+			if(!ok) break;
+			if(c->GetSize() == 0) continue;
+
+			uint64_t stored;
+			ok = c->Prepare(&packed, &stored);
+			if(!ok) break;
+
+			size += stored + 16;
+			out.push_back(c);
+		}
+
+		if(ok)
+		{
+			SequentialWriter w(SavePath(), size + 16, direct);
+			auto h = IFF_FILEID;
+			w.Write(&h, 8);
+			w.Write(&size, 8);
+			for(auto c : out)
+			{
+				ok = c->WriteSequential(&w, &packed);
+				if(!ok) break;
+			}
+			ok = ok && w.Finish();
+		}
+		return EndSave(ok);
+	}
+
+
+#pragma mark Atomic saving
+	// Flush a finished temporary file to disk and move it over the target,
+	// then make the rename durable. Until the rename, the target is
+	// untouched, so a crash leaves either the old file or the new one.
+	static void CommitTemp(string temp, string target, bool *ok)
+	{
+		int fd = open(temp.c_str(), O_WRONLY);
+		bool good = fd >= 0 && fsync(fd) == 0;
+		if(fd >= 0) close(fd);
+		good = good && rename(temp.c_str(), target.c_str()) == 0;
+		if(!good)
+		{
+			unlink(temp.c_str());
+			*ok = false;
+			return;
+		}
+
+		auto slash = target.rfind('/');
+		string dir = slash == string::npos ? "." : (slash == 0 ? "/" : target.substr(0, slash));
+		int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+		if(dfd >= 0)
+		{
+			good = fsync(dfd) == 0;
+			close(dfd);
+		}
+		*ok = good;
+	}
+
+
+	// The file saves are written to.
+	string IFF::SavePath()
+	{
+		return temppath.size() ? temppath : filename;
+	}
+
+
+	// Create a temporary file next to the target, and point the file
+	// stream at it. It gets the permissions of the file it will replace.
+	bool IFF::OpenTemp()
+	{
+		if(f.is_open()) f.close();
+		DropTemp();
+		string pattern = filename + ".XXXXXX";
+		vector<char> name(pattern.begin(), pattern.end());
+		name.push_back(0);
+		int fd = mkstemp(name.data());
+		if(fd < 0) return false;
+
+		struct stat st;
+		fchmod(fd, stat(filename.c_str(), &st) == 0 ? st.st_mode & 07777 : 0644);
+		close(fd);
+		temppath = name.data();
+		f.open(temppath, ios::binary | ios::out | ios::trunc);
+		return f.is_open();
+	}
+
+
+	// Remove a temporary file that was never committed.
+	void IFF::DropTemp()
+	{
+		if(temppath.empty()) return;
+
+		unlink(temppath.c_str());
+		temppath.clear();
+	}
+
+
+	// Saves are committed in order, each to a fresh temporary file.
+	bool IFF::BeginSave()
+	{
+		WaitForSave();
+		syncok = true;
+		// Writing would truncate the file the chunks are read from.
+		if(!writable) return false;
+		if(!atomic) return f.is_open();
+
+		// The one made when opening hasn't been used yet.
+		if(temppath.size() && f.is_open() && f.tellp() == 0) return true;
+
+		return OpenTemp();
+	}
+
+
+	// Commit a finished save, or throw away a failed one.
+	// In the background, the result comes from WaitForSave().
+	bool IFF::EndSave(bool ok)
+	{
+		if(!atomic) return ok;
+
+		f.flush();
+		if(!ok || !f.good())
+		{
+			DropTemp();
+			return false;
+		}
+
+		auto temp = temppath;
+		temppath.clear();
+		if(background)
+		{
+			syncer = thread(CommitTemp, temp, filename, &syncok);
+			return true;
+		}
+
+		CommitTemp(temp, filename, &syncok);
+		return syncok;
+	}
+
+
+	// With atomic saving, let Save() and SaveSequential() return once
+	// the data is written, and sync and rename on another thread.
+	void IFF::SyncInBackground(bool enable)
+	{
+		background = enable;
+	}
+
+
+	// Wait for a background sync to finish.
+	// Returns false if the last save couldn't be committed.
+	bool IFF::WaitForSave()
+	{
+		if(syncer.joinable()) syncer.join();
+		return syncok;
 	}
 } // End namespace IFF
@@ -0,0 +1,197 @@
+//
+//  pool.cpp
+//  Per-thread pools of zlib contexts and I/O buffers.
+//
+//  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
+//
+
+#include <atomic>
+#include <vector>
+#include "pool.h"
+
+namespace IFFSpace
+{
+	using namespace std;
+
+	// Idle objects kept per thread, beyond which they are freed.
+	#define POOL_MAXIDLE 8
+
+	static atomic<uint64_t> deflateinits, deflatereuses;
+	static atomic<uint64_t> inflateinits, inflatereuses;
+	static atomic<uint64_t> bufferallocs, bufferreuses;
+
+	// The idle objects of one thread, freed when the thread exits.
+	struct ThreadPool
+	{
+		vector<z_stream *>	deflaters;
+		vector<z_stream *>	inflaters;
+		vector<char *>		buffers;
+
+		~ThreadPool()
+		{
+			for(auto z : deflaters)
+			{
+				deflateEnd(z);
+				delete z;
+			}
+			for(auto z : inflaters)
+			{
+				inflateEnd(z);
+				delete z;
+			}
+			for(auto b : buffers) delete[] b;
+		}
+	};
+
+	static thread_local ThreadPool pool;
+
+
+	// Resetting leaves the buffer pointers alone, so clear them too.
+	static void ClearBuffers(z_stream *z)
+	{
+		z->next_in = nullptr;
+		z->avail_in = 0;
+		z->next_out = nullptr;
+		z->avail_out = 0;
+	}
+
+
+#pragma mark Statistics
+	CompressionStats GetCompressionStats()
+	{
+		CompressionStats s;
+		s.deflateinits = deflateinits;
+		s.deflatereuses = deflatereuses;
+		s.inflateinits = inflateinits;
+		s.inflatereuses = inflatereuses;
+		s.bufferallocs = bufferallocs;
+		s.bufferreuses = bufferreuses;
+		return s;
+	}
+
+
+	void ResetCompressionStats()
+	{
+		deflateinits = deflatereuses = 0;
+		inflateinits = inflatereuses = 0;
+		bufferallocs = bufferreuses = 0;
+	}
+
+
+#pragma mark PooledDeflate
+	// All chunks are compressed at the same level, so a reset is enough.
+	PooledDeflate::PooledDeflate()
+	{
+		if(pool.deflaters.size())
+		{
+			z = pool.deflaters.back();
+			pool.deflaters.pop_back();
+			if(deflateReset(z) == Z_OK)
+			{
+				ClearBuffers(z);
+				deflatereuses++;
+				return;
+			}
+			deflateEnd(z);
+			delete z;
+		}
+
+		z = new z_stream;
+		z->zalloc = 0;
+		z->zfree = 0;
+		z->opaque = 0;
+		ClearBuffers(z);
+		if(deflateInit(z, Z_BEST_COMPRESSION) != Z_OK)
+		{
+			delete z;
+			z = nullptr;
+			return;
+		}
+		deflateinits++;
+	}
+
+
+	PooledDeflate::~PooledDeflate()
+	{
+		if(!z) return;
+
+		if(pool.deflaters.size() < POOL_MAXIDLE)
+		{
+			pool.deflaters.push_back(z);
+		} else {
+			deflateEnd(z);
+			delete z;
+		}
+	}
+
+
+#pragma mark PooledInflate
+	PooledInflate::PooledInflate()
+	{
+		if(pool.inflaters.size())
+		{
+			z = pool.inflaters.back();
+			pool.inflaters.pop_back();
+			if(inflateReset(z) == Z_OK)
+			{
+				ClearBuffers(z);
+				inflatereuses++;
+				return;
+			}
+			inflateEnd(z);
+			delete z;
+		}
+
+		z = new z_stream;
+		z->zalloc = 0;
+		z->zfree = 0;
+		z->opaque = 0;
+		ClearBuffers(z);
+		if(inflateInit(z) != Z_OK)
+		{
+			delete z;
+			z = nullptr;
+			return;
+		}
+		inflateinits++;
+	}
+
+
+	PooledInflate::~PooledInflate()
+	{
+		if(!z) return;
+
+		if(pool.inflaters.size() < POOL_MAXIDLE)
+		{
+			pool.inflaters.push_back(z);
+		} else {
+			inflateEnd(z);
+			delete z;
+		}
+	}
+
+
+#pragma mark PooledBuffer
+	PooledBuffer::PooledBuffer()
+	{
+		if(pool.buffers.size())
+		{
+			buf = pool.buffers.back();
+			pool.buffers.pop_back();
+			bufferreuses++;
+			return;
+		}
+
+		buf = new char[IFF_POOL_BUFSIZE];
+		bufferallocs++;
+	}
+
+
+	PooledBuffer::~PooledBuffer()
+	{
+		if(pool.buffers.size() < POOL_MAXIDLE)
+			pool.buffers.push_back(buf);
+		else
+			delete[] buf;
+	}
+} // End namespace IFFSpace
@@ -0,0 +1,442 @@
+//
+//  iffstat.cpp
+//	IFF layout inspector and load profiler.
+//
+//  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
+//
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+#include "iff.h"
+#include "text.h"
+#include "getopt.h"
+
+#define PROGRAM "iffstat"
+#define VERSION "0.1.0"
+
+using namespace std;
+using namespace IFFSpace;
+
+// Chunks smaller than this cost a seek each when loaded one by one.
+#define SMALL_CHUNK 4096
+
+// A chunk with its nesting depth, in file order.
+struct Entry
+{
+	Chunk			*chunk;
+	uint32_t		depth;
+	bool			inside;		// Within a chunk of the same type, so already counted
+};
+
+// Totals for one chunk type.
+struct TypeStats
+{
+	uint64_t		count = 0;
+	uint64_t		stored = 0;		// Bytes in the file
+	uint64_t		size = 0;		// Bytes once loaded
+	double			load = 0;		// Seconds reading
+	double			decompress = 0;	// Seconds inflating
+};
+
+typedef map<uint64_t, TypeStats> TypeMap;
+
+// A contiguous piece of the file on disk.
+struct Extent
+{
+	uint64_t		logical;
+	uint64_t		physical;
+	uint64_t		length;
+};
+
+void usage();
+string idstring(uint64_t id);
+string jsonstring(const string &s);
+void flatten(Chunk *c, uint32_t depth, vector<Entry> *out, map<uint64_t, uint32_t> *open);
+uint64_t unpacked(fstream *f, Chunk *c);
+bool extents(const string &file, vector<Extent> *out);
+int inspect(IFF *iff, bool tree);
+int profile(IFF *iff, double scan);
+
+void usage()
+{
+	cout << PROGRAM << " " << VERSION << endl;
+	cout << "Usage: " << PROGRAM << " [options] FILE\n";
+	cout << " -h, --help				Show this help/usage text.\n";
+	cout << " -c, --container=ID		Treat chunks with this ID as containers.\n";
+	cout << " -s, --summary			Skip the chunk tree.\n";
+	cout << " -p, --profile			Time scan, load and decompress per chunk type, as JSON.\n";
+}
+
+
+// Chunk identifier as text, with unprintable characters as dots.
+string idstring(uint64_t id)
+{
+	string s(8, ' ');
+	for(int i = 0; i < 8; i++)
+	{
+		char c = (char)(id >> (i * 8));
+		s[i] = (c >= 0x20 && c <= 0x7e) ? c : '.';
+	}
+	return s;
+}
+
+
+// Quote a string for JSON output.
+string jsonstring(const string &s)
+{
+	string out = "\"";
+	for(auto c : s)
+	{
+		if(c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		} else if((unsigned char)c < 0x20) {
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			out += esc;
+		} else {
+			out += c;
+		}
+	}
+	return out + "\"";
+}
+
+
+// List a chunk and its sub-chunks in file order.
+// Open counts the chunks of each type the current one is inside.
+void flatten(Chunk *c, uint32_t depth, vector<Entry> *out, map<uint64_t, uint32_t> *open)
+{
+	auto &within = (*open)[c->GetID()];
+	out->push_back({c, depth, within > 0});
+	within++;
+	for(size_t i = 0; i < c->NumChunks(); i++) flatten(c->GetChunk(i), depth + 1, out, open);
+	within--;
+}
+
+
+// Uncompressed size of a compressed chunk, from the start of its data.
+uint64_t unpacked(fstream *f, Chunk *c)
+{
+	uint64_t realsize = 0;
+	if(c->GetSize() < 8) return 0;
+
+	f->seekg((off_t)c->GetOffset(), ios::beg);
+	f->read((char *)&realsize, 8);
+	return f->good() ? realsize : 0;
+}
+
+
+// Ask the filesystem where the file lives on disk.
+// Returns false if it can't tell.
+bool extents(const string &file, vector<Extent> *out)
+{
+#ifdef __linux__
+	int fd = open(file.c_str(), O_RDONLY);
+	if(fd < 0) return false;
+
+	const uint32_t batch = 256;
+	vector<char> buf(sizeof(struct fiemap) + batch * sizeof(struct fiemap_extent));
+	auto fm = (struct fiemap *)buf.data();
+	uint64_t start = 0;
+	bool last = false;
+	while(!last)
+	{
+		memset(buf.data(), 0, buf.size());
+		fm->fm_start = start;
+		fm->fm_length = FIEMAP_MAX_OFFSET - start;
+		// No FIEMAP_FLAG_SYNC: an inspector shouldn't force writeback.
+		// Data still waiting in the page cache may show up unmapped.
+		fm->fm_flags = 0;
+		fm->fm_extent_count = batch;
+		if(ioctl(fd, FS_IOC_FIEMAP, fm) != 0)
+		{
+			close(fd);
+			return false;
+		}
+		if(fm->fm_mapped_extents == 0) break;
+
+		for(uint32_t i = 0; i < fm->fm_mapped_extents; i++)
+		{
+			auto &e = fm->fm_extents[i];
+			// Extents that follow on from each other on disk are one piece.
+			if(out->size() && e.fe_logical == out->back().logical + out->back().length
+				&& e.fe_physical == out->back().physical + out->back().length)
+				out->back().length += e.fe_length;
+			else
+				out->push_back({e.fe_logical, e.fe_physical, e.fe_length});
+			start = e.fe_logical + e.fe_length;
+			if(e.fe_flags & FIEMAP_EXTENT_LAST) last = true;
+		}
+	}
+	close(fd);
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+// Print the chunk tree, per-type totals and a layout summary.
+int inspect(IFF *iff, bool tree)
+{
+	fstream f(iff->GetFilename(), ios::in | ios::binary);
+	if(!f.is_open()) return 2;
+
+	vector<Entry> entries;
+	map<uint64_t, uint32_t> open;
+	for(size_t i = 0; i < iff->NumChunks(); i++) flatten(iff->GetChunk(i), 0, &entries, &open);
+
+	TypeMap types;
+	uint32_t maxdepth = 0;
+	uint64_t small = 0;
+	uint64_t compressed = 0;
+	uint64_t beforedict = 0;
+	bool dict = false;
+	if(tree) cout << "ID                                 Offset             Size\n";
+	for(auto &e : entries)
+	{
+		auto c = e.chunk;
+		auto id = c->GetID();
+		auto &t = types[id];
+		t.count++;
+		// Nested chunks of the same type are part of the outer one's size.
+		if(!e.inside) t.stored += c->GetSize();
+		maxdepth = max(maxdepth, e.depth);
+		uint64_t realsize = c->GetSize();
+		if(!c->IsContainer())
+		{
+			if(IsCompressedID(id))
+			{
+				realsize = unpacked(&f, c);
+				compressed++;
+				if(!dict) beforedict++;
+			}
+			if(c->GetSize() < SMALL_CHUNK) small++;
+		}
+		if(id == IFF_ZDICT) dict = true;
+		if(!e.inside) t.size += realsize;
+
+		if(!tree) continue;
+
+		cout << left << setw(24) << string(e.depth * 2, ' ') + idstring(id)
+			<< right << setw(17) << c->GetOffset() << " " << setw(16) << c->GetSize();
+		if(c->IsContainer())
+			cout << "  (" << c->NumChunks() << " chunks)";
+		else if(IsCompressedID(id))
+			cout << "  -> " << realsize;
+		cout << "\n";
+	}
+
+	cout << "\nFile " << iff->GetFilename() << ": " << iff->GetSize() + 16 << " bytes, "
+		<< entries.size() << " chunks, " << iff->NumChunks() << " at top level, nesting depth " << maxdepth << ".\n\n";
+
+	cout << "Type          Count           Stored         Unpacked   Ratio\n";
+	for(auto &it : types)
+	{
+		auto &t = it.second;
+		cout << idstring(it.first) << " " << setw(10) << t.count << " " << setw(16) << t.stored << " " << setw(16) << t.size;
+		if(IsCompressedID(it.first) && t.size)
+			cout << "  " << fixed << setprecision(1) << setw(5) << 100.0 * (double)t.stored / (double)t.size << "%";
+		cout << "\n";
+	}
+
+	// Where the data ends up on disk, and what that means for chunks.
+	cout << "\nLayout:\n";
+	vector<Extent> ext;
+	if(extents(iff->GetFilename(), &ext))
+	{
+		uint64_t split = 0;
+		size_t x = 0;
+		for(auto &e : entries)
+		{
+			auto c = e.chunk;
+			if(c->IsContainer() || c->GetSize() == 0) continue;
+
+			auto from = c->GetOffset();
+			auto to = from + c->GetSize();
+			while(x < ext.size() && ext[x].logical + ext[x].length <= from) x++;
+			if(x < ext.size() && to > ext[x].logical + ext[x].length) split++;
+		}
+		uint64_t largest = 0;
+		for(auto &e : ext) largest = max(largest, e.length);
+		cout << "  " << ext.size() << " extents on disk, largest " << largest << " bytes.\n";
+		cout << "  " << split << " chunks split across extents.\n";
+	} else {
+		cout << "  Extent information is not available for this file.\n";
+	}
+	cout << "  " << small << " chunks smaller than " << SMALL_CHUNK << " bytes.\n";
+	if(dict && beforedict)
+		cout << "  " << beforedict << " of " << compressed << " compressed chunks come before the first ZDICT chunk.\n";
+	return 0;
+}
+
+
+// Time scanning, then loading and decompressing every chunk by type,
+// and print the result as JSON.
+int profile(IFF *iff, double scan)
+{
+	typedef chrono::steady_clock clock;
+	fstream f(iff->GetFilename(), ios::in | ios::binary);
+	if(!f.is_open()) return 2;
+
+	vector<Entry> entries;
+	map<uint64_t, uint32_t> open;
+	for(size_t i = 0; i < iff->NumChunks(); i++) flatten(iff->GetChunk(i), 0, &entries, &open);
+
+	TypeMap types;
+	uint32_t maxdepth = 0;
+	bool ok = true;
+	for(auto &e : entries)
+	{
+		auto c = e.chunk;
+		auto id = c->GetID();
+		auto &t = types[id];
+		t.count++;
+		// Nested chunks of the same type are part of the outer one's size.
+		if(!e.inside) t.stored += c->GetSize();
+		maxdepth = max(maxdepth, e.depth);
+		if(c->GetSize() == 0) continue;
+
+		// Containers have nothing of their own to load, and dictionaries
+		// were loaded by the scan and are needed later.
+		if(c->IsContainer() || id == IFF_ZDICT)
+		{
+			if(!e.inside) t.size += c->GetSize();
+			continue;
+		}
+
+		auto t0 = clock::now();
+		if(IsCompressedID(id))
+		{
+			auto stored = c->GetSize();
+			auto buf = new char[stored];
+			f.seekg((off_t)c->GetOffset(), ios::beg);
+			f.read(buf, (streamsize)stored);
+			auto t1 = clock::now();
+			ok &= f.good() && c->UnpackZlib(buf, stored);
+			delete[] buf;
+			t.load += chrono::duration<double>(t1 - t0).count();
+			t.decompress += chrono::duration<double>(clock::now() - t1).count();
+		} else {
+			ok &= c->ReadData(&f);
+			t.load += chrono::duration<double>(clock::now() - t0).count();
+		}
+		t.size += c->GetSize();
+		c->Clear();
+	}
+
+	double load = 0, decompress = 0;
+	cout << fixed << setprecision(6);
+	cout << "{\n";
+	cout << "\t\"file\": " << jsonstring(iff->GetFilename()) << ",\n";
+	cout << "\t\"size\": " << iff->GetSize() + 16 << ",\n";
+	cout << "\t\"chunks\": " << entries.size() << ",\n";
+	cout << "\t\"depth\": " << maxdepth << ",\n";
+	cout << "\t\"ok\": " << (ok ? "true" : "false") << ",\n";
+	cout << "\t\"scan\": " << scan << ",\n";
+	cout << "\t\"types\": [";
+	bool first = true;
+	for(auto &it : types)
+	{
+		auto &t = it.second;
+		load += t.load;
+		decompress += t.decompress;
+		cout << (first ? "\n" : ",\n");
+		cout << "\t\t{\"id\": " << jsonstring(idstring(it.first)) << ", \"count\": " << t.count
+			<< ", \"stored\": " << t.stored << ", \"size\": " << t.size
+			<< ", \"load\": " << t.load << ", \"decompress\": " << t.decompress << "}";
+		first = false;
+	}
+	cout << "\n\t],\n";
+	cout << "\t\"load\": " << load << ",\n";
+	cout << "\t\"decompress\": " << decompress << "\n";
+	cout << "}\n";
+	return ok ? 0 : 2;
+}
+
+
+int main(int argc, char * const *argv)
+{
+	static struct option longopts[] = {
+		{"help", no_argument, nullptr, 'h'},
+		{"container", required_argument, nullptr, 'c'},
+		{"summary", no_argument, nullptr, 's'},
+		{"profile", no_argument, nullptr, 'p'},
+		{nullptr, 0, nullptr, 0}
+	};
+
+	vector<uint64_t> containers;
+	bool tree = true;
+	bool prof = false;
+	int ch;
+	while((ch = getopt_long(argc, argv, "hc:sp", longopts, NULL)) != -1)
+	{
+		switch(ch)
+		{
+			case 'h':
+				usage();
+				return 0;
+				break;
+			case 'c':
+			{
+				// Pad to eight characters, like MakeID().
+				uint64_t id = 0;
+				for(int i = 0; i < 8; i++)
+					id |= (uint64_t)(uint8_t)(i < (int)strlen(optarg) ? optarg[i] : ' ') << (i * 8);
+				containers.push_back(id);
+				break;
+			}
+			case 's':
+				tree = false;
+				break;
+			case 'p':
+				prof = true;
+				break;
+			case 0:
+				break;
+
+			default:
+				usage();
+				return 0;
+				break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if(argc < 1)
+	{
+		usage();
+		return 1;
+	}
+
+	// Containers have to be known before scanning, so scan again if any
+	// were added. Only the scan that counts is timed.
+	auto t0 = chrono::steady_clock::now();
+	auto iff = new IFF(argv[0]);
+	if(containers.size())
+	{
+		for(auto id : containers) iff->RegisterContainer(id);
+		t0 = chrono::steady_clock::now();
+		iff->Reopen();
+	}
+	double scan = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+	if(!iff->OK() || iff->NumChunks() == 0)
+	{
+		cout << "Couldn't read '" << argv[0] << "' as an IFF file.\n";
+		delete iff;
+		return 2;
+	}
+
+	int ret = prof ? profile(iff, scan) : inspect(iff, tree);
+	delete iff;
+	return ret;
+}
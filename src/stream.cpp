@@ -0,0 +1,259 @@
+//
+//  stream.cpp
+//  Single-pass IFF reader for non-seekable inputs.
+//
+//  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
+//
+
+#include <errno.h>
+#include <unistd.h>
+#include "stream.h"
+#include "text.h"
+#include "pool.h"
+
+namespace IFFSpace
+{
+	// Larger ZDICT chunks are treated as ordinary data.
+	#define STREAM_MAXDICT 1024 * 1024
+
+#pragma mark Byte sources
+	uint64_t StreamSource::Read(char *buf, uint64_t len)
+	{
+		in->read(buf, (streamsize)len);
+		return (uint64_t)in->gcount();
+	}
+
+
+	uint64_t FileSource::Read(char *buf, uint64_t len)
+	{
+		ssize_t got;
+		do
+		{
+			got = read(fd, buf, len);
+		} while(got < 0 && errno == EINTR);
+		return got > 0 ? (uint64_t)got : 0;
+	}
+
+
+#pragma mark StreamReader constructor
+	StreamReader::StreamReader(ByteSource *source, bool unpack)
+	{
+		src = source;
+		decompress = unpack;
+		size = 0;
+		consumed = 0;
+
+		// Set up known container chunk identifiers
+		RegisterContainer(IFF_FOLDER);
+	}
+
+
+	void StreamReader::RegisterContainer(uint64_t identifier)
+	{
+		containers[identifier] = true;
+	}
+
+
+	void StreamReader::UnregisterContainer(uint64_t identifier)
+	{
+		containers.erase(identifier);
+	}
+
+
+	// Size of the file contents after the header, once Run() has read it.
+	uint64_t StreamReader::GetSize()
+	{
+		return size;
+	}
+
+
+	uint64_t StreamReader::GetConsumed()
+	{
+		return consumed;
+	}
+
+
+#pragma mark Reading
+	// Read exactly len bytes, or fail.
+	bool StreamReader::ReadFully(char *dst, uint64_t len)
+	{
+		while(len)
+		{
+			auto got = src->Read(dst, len);
+			if(got == 0) return false;
+
+			dst += got;
+			len -= got;
+			consumed += got;
+		}
+		return true;
+	}
+
+
+	// Read and discard len bytes.
+	bool StreamReader::Drain(uint64_t len)
+	{
+		while(len)
+		{
+			auto n = min(len, (uint64_t)buf.Size());
+			if(!ReadFully(buf.Get(), n)) return false;
+
+			len -= n;
+		}
+		return true;
+	}
+
+
+	// Parse the header and walk every chunk.
+	// Returns false on malformed or truncated input, or if the handler
+	// stopped reading.
+	bool StreamReader::Run(StreamHandler *handler)
+	{
+		uint64_t h;
+		consumed = 0;
+		if(!ReadFully((char *)&h, 8) || h != IFF_FILEID) return false;
+		if(!ReadFully((char *)&size, 8)) return false;
+
+		return Walk(handler, size + 16, 0);
+	}
+
+
+	// Walk chunks until the stream reaches the end offset.
+	bool StreamReader::Walk(StreamHandler *handler, uint64_t end, uint32_t depth)
+	{
+		while(consumed < end)
+		{
+			uint64_t id, len;
+			if(end - consumed < 16) return false;
+			if(!ReadFully((char *)&id, 8) || !ReadFully((char *)&len, 8)) return false;
+			// A chunk can't be larger than what's left of its parent.
+			if(len > end - consumed) return false;
+
+			if(containers.find(id) != containers.end())
+			{
+				if(!handler->EnterContainer(id, len, depth))
+				{
+					if(!Drain(len)) return false;
+					continue;
+				}
+				if(!Walk(handler, consumed + len, depth + 1)) return false;
+				handler->LeaveContainer(id, depth);
+			} else if(id == IFF_ZDICT && len <= STREAM_MAXDICT) {
+				if(!ReadDictionary(handler, len, depth)) return false;
+			} else if(handler->Want(id, len, depth)) {
+				bool ok;
+				if(decompress && IsCompressedID(id))
+					ok = DeliverZlib(handler, id, len);
+				else
+					ok = Deliver(handler, id, len);
+				if(!ok) return false;
+			} else {
+				if(!Drain(len)) return false;
+			}
+		}
+		return consumed == end;
+	}
+
+
+	// Keep a shared dictionary for the compressed chunks that follow,
+	// and pass it on to the handler if wanted.
+	bool StreamReader::ReadDictionary(StreamHandler *handler, uint64_t len, uint32_t depth)
+	{
+		string dict(len, 0);
+		if(!ReadFully(dict.data(), len)) return false;
+
+		dictionaries.Add(dict.data(), len);
+		if(!handler->Want(IFF_ZDICT, len, depth)) return true;
+		if(len && !handler->Data(IFF_ZDICT, dict.data(), len, 0)) return false;
+
+		handler->EndChunk(IFF_ZDICT, len);
+		return true;
+	}
+
+
+	// Pass len bytes to the handler as they are read.
+	bool StreamReader::Deliver(StreamHandler *handler, uint64_t id, uint64_t len)
+	{
+		uint64_t offset = 0;
+		while(offset < len)
+		{
+			auto n = min(len - offset, (uint64_t)buf.Size());
+			if(!ReadFully(buf.Get(), n)) return false;
+			if(!handler->Data(id, buf.Get(), n, offset)) return false;
+
+			offset += n;
+		}
+		handler->EndChunk(id, len);
+		return true;
+	}
+
+
+	// Inflate len bytes of compressed chunk data as they are read,
+	// passing the output to the handler.
+	bool StreamReader::DeliverZlib(StreamHandler *handler, uint64_t id, uint64_t len)
+	{
+		uint64_t realsize;
+		if(len < 8 || !ReadFully((char *)&realsize, 8)) return false;
+
+		len -= 8;
+		PooledInflate pz;
+		if(!pz.OK()) return false;
+
+		auto &z = *pz.Get();
+		uint64_t offset = 0;
+		int ret = Z_OK;
+		bool ok = true;
+		while(ok && ret != Z_STREAM_END)
+		{
+			if(z.avail_in == 0)
+			{
+				if(len == 0)
+				{
+					ok = false;
+					break;
+				}
+				auto n = min(len, (uint64_t)buf.Size());
+				if(!ReadFully(buf.Get(), n))
+				{
+					ok = false;
+					break;
+				}
+				len -= n;
+				z.next_in = (unsigned char *)buf.Get();
+				z.avail_in = (uInt)n;
+			}
+			z.next_out = (unsigned char *)out.Get();
+			z.avail_out = (uInt)out.Size();
+			ret = inflate(&z, Z_NO_FLUSH);
+			if(ret == Z_NEED_DICT)
+			{
+				auto dict = dictionaries.Find((uint32_t)z.adler);
+				if(!dict || inflateSetDictionary(&z, (const Bytef *)dict->data(), (uInt)dict->size()) != Z_OK)
+				{
+					ok = false;
+					break;
+				}
+				continue;
+			}
+			if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+			{
+				ok = false;
+				break;
+			}
+
+			auto have = out.Size() - z.avail_out;
+			if(have)
+			{
+				ok = handler->Data(id, out.Get(), have, offset);
+				offset += have;
+			}
+		}
+		if(!ok || offset != realsize) return false;
+
+		// Skip anything trailing the compressed stream.
+		if(!Drain(len)) return false;
+
+		handler->EndChunk(id, offset);
+		return true;
+	}
+} // End namespace IFFSpace
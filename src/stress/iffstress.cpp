@@ -0,0 +1,506 @@
+//
+//  iffstress.cpp
+//	Large-archive stress and scaling tests.
+//
+//  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "iff.h"
+#include "async.h"
+#include "stream.h"
+#include "text.h"
+#include "getopt.h"
+
+#define PROGRAM "iffstress"
+#define VERSION "0.1.0"
+
+using namespace std;
+using namespace IFFSpace;
+
+// Chunks per folder in the many-chunk archive.
+#define PER_FOLDER 1000
+
+void usage();
+void fill(char *buf, uint64_t index, uint64_t len);
+bool check(const char *buf, uint64_t index, uint64_t len);
+void build(IFF *iff, uint64_t count);
+bool verify(IFF *iff, uint64_t count);
+bool roundtrip(const string &path, uint64_t count, bool sequential);
+bool many(const string &dir, uint64_t count);
+bool deep(const string &dir, uint32_t depth);
+bool threaded(const string &dir, uint64_t count, unsigned threads);
+bool big(const string &dir, uint64_t size, uint64_t id);
+bool huge(const string &dir, uint64_t size, uint64_t id);
+bool big(const string &dir, uint64_t size, uint64_t id);
+
+// Timing and memory use for each phase of the run.
+class PhaseLog
+{
+	struct Phase
+	{
+		string			name;
+		double			seconds;
+		uint64_t		rss;		// Resident at the end of the phase
+		uint64_t		peak;		// Peak resident so far
+		bool			ok;
+	};
+	vector<Phase>		phases;
+	string				current;
+	chrono::steady_clock::time_point start;
+
+public:
+	void Start(const string &name)
+	{
+		current = name;
+		cout << name << "..." << flush;
+		start = chrono::steady_clock::now();
+	}
+
+	bool Stop(bool ok)
+	{
+		Phase p;
+		p.name = current;
+		p.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		p.ok = ok;
+		struct rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		p.peak = (uint64_t)ru.ru_maxrss * 1024;
+		p.rss = 0;
+		FILE *statm = fopen("/proc/self/statm", "r");
+		if(statm)
+		{
+			unsigned long pages, resident;
+			if(fscanf(statm, "%lu %lu", &pages, &resident) == 2) p.rss = (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE);
+			fclose(statm);
+		}
+		// The kernel updates ru_maxrss lazily, so it can trail statm.
+		p.peak = max(p.peak, p.rss);
+		if(phases.size()) p.peak = max(p.peak, phases.back().peak);
+		phases.push_back(p);
+		cout << (ok ? " OK" : " FAILED") << endl;
+		return ok;
+	}
+
+	void Print()
+	{
+		cout << "\nPhase                        Seconds     RSS MB    Peak MB  Result\n";
+		for(auto &p : phases)
+		{
+			cout << left << setw(24) << p.name << right << fixed << setprecision(3) << setw(12) << p.seconds
+				<< setprecision(1) << setw(11) << (double)p.rss / 1048576.0 << setw(11) << (double)p.peak / 1048576.0
+				<< "  " << (p.ok ? "OK" : "FAILED") << "\n";
+		}
+	}
+};
+
+static PhaseLog phases;
+
+void usage()
+{
+	cout << PROGRAM << " " << VERSION << endl;
+	cout << "Usage:\n";
+	cout << " -h, --help				Show this help/usage text.\n";
+	cout << " -d, --dir=DIR			Directory for the test archives (default: current).\n";
+	cout << " -n, --chunks=N			Chunks in the large archive (default: 1000000).\n";
+	cout << " -D, --depth=N			Folder nesting depth (default: 4096).\n";
+	cout << " -t, --threads=N			Threads saving and loading at once (default: 4).\n";
+	cout << " -b, --big=MB			Also test single chunks of MB megabytes (needs that much memory).\n";
+	cout << " -H, --huge=MB			Size of the streamed single chunk test, over 4096 or 0 to skip\n";
+	cout << "				(default: 4097, needs that much disk space).\n";
+	cout << " -k, --keep				Keep the test archives afterwards.\n";
+}
+
+
+#pragma mark Test data
+// Fill a chunk with text that depends on its index.
+void fill(char *buf, uint64_t index, uint64_t len)
+{
+	for(uint64_t i = 0; i < len; i++) buf[i] = (char)('a' + (index * 31 + i) % 26);
+}
+
+
+bool check(const char *buf, uint64_t index, uint64_t len)
+{
+	if(!buf) return len == 0;
+
+	for(uint64_t i = 0; i < len; i++)
+		if(buf[i] != (char)('a' + (index * 31 + i) % 26)) return false;
+	return true;
+}
+
+
+// Add count chunks of varying size in folders, every fourth one compressed.
+void build(IFF *iff, uint64_t count)
+{
+	char buf[64];
+	Chunk *folder = nullptr;
+	for(uint64_t i = 0; i < count; i++)
+	{
+		if(i % PER_FOLDER == 0) folder = iff->AddChunk(IFF_FOLDER);
+		auto len = 16 + i % 48;
+		fill(buf, i, len);
+		folder->AddChunk(i % 4 ? IFF_UTF8 : IFF_COMP_UTF8, buf, len);
+	}
+}
+
+
+// Check that every chunk from build() came back as it went in.
+bool verify(IFF *iff, uint64_t count)
+{
+	if(iff->NumChunks() != (count + PER_FOLDER - 1) / PER_FOLDER) return false;
+
+	uint64_t i = 0;
+	for(size_t f = 0; f < iff->NumChunks(); f++)
+	{
+		auto folder = iff->GetChunk(f);
+		if(folder->GetID() != IFF_FOLDER) return false;
+
+		for(size_t j = 0; j < folder->NumChunks(); j++, i++)
+		{
+			auto c = folder->GetChunk(j);
+			auto len = 16 + i % 48;
+			if(c->GetID() != (i % 4 ? IFF_UTF8 : IFF_COMP_UTF8) || c->GetSize() != len) return false;
+			if(!check(c->GetData(), i, len)) return false;
+		}
+	}
+	return i == count;
+}
+
+
+// Build, save, reopen, load and verify an archive without timing it.
+bool roundtrip(const string &path, uint64_t count, bool sequential)
+{
+	auto iff = new IFF(path, true);
+	build(iff, count);
+	bool ok = sequential ? iff->SaveSequential() : iff->Save();
+	ok &= iff->Reopen();
+	ok &= iff->LoadAllChunks();
+	ok &= verify(iff, count);
+	delete iff;
+	return ok;
+}
+
+
+#pragma mark Tests
+// Millions of small chunks.
+bool many(const string &dir, uint64_t count)
+{
+	auto path = dir + "/iffstress-many.iff";
+	auto iff = new IFF(path, true);
+	if(!iff->OK()) return false;
+
+	phases.Start("many: build");
+	build(iff, count);
+	phases.Stop(true);
+
+	phases.Start("many: save");
+	bool ok = phases.Stop(iff->Save());
+
+	phases.Start("many: reopen");
+	ok &= phases.Stop(iff->Reopen() && iff->GetTable()->NumChunks() == count + iff->NumChunks());
+
+	phases.Start("many: load");
+	ok &= phases.Stop(iff->LoadAllChunks());
+
+	phases.Start("many: verify");
+	ok &= phases.Stop(verify(iff, count));
+
+	// Saving needs a writable archive, so build it again from scratch.
+	iff->Reopen(true);
+	build(iff, count);
+	phases.Start("many: save sequential");
+	ok &= phases.Stop(iff->SaveSequential());
+
+	phases.Start("many: reload");
+	ok &= iff->Reopen();
+	ok &= phases.Stop(ok && iff->LoadAllChunks() && verify(iff, count));
+	delete iff;
+	return ok;
+}
+
+
+// One chunk at the bottom of a long chain of folders.
+bool deep(const string &dir, uint32_t depth)
+{
+	auto path = dir + "/iffstress-deep.iff";
+	auto iff = new IFF(path, true);
+	if(!iff->OK()) return false;
+
+	char buf[64];
+	fill(buf, depth, sizeof(buf));
+	phases.Start("deep: save");
+	auto c = iff->AddChunk(IFF_FOLDER);
+	for(uint32_t i = 1; i < depth; i++) c = c->AddChunk(IFF_FOLDER);
+	c->AddChunk(IFF_UTF8, buf, sizeof(buf));
+	bool ok = phases.Stop(iff->Save());
+
+	phases.Start("deep: reopen");
+	ok &= iff->Reopen();
+	auto table = iff->GetTable();
+	ok &= phases.Stop(ok && table->NumChunks() == depth + 1 && table->GetDepth(depth) == depth);
+
+	phases.Start("deep: load");
+	ok &= iff->LoadAllChunks();
+	c = iff->NumChunks() ? iff->GetChunk(0) : nullptr;
+	for(uint32_t i = 0; c && i < depth; i++) c = c->NumChunks() == 1 ? c->GetChunk(0) : nullptr;
+	ok &= phases.Stop(ok && c && c->GetID() == IFF_UTF8 && c->GetSize() == sizeof(buf) && check(c->GetData(), depth, sizeof(buf)));
+	delete iff;
+	return ok;
+}
+
+
+// Several archives saved and loaded at once, then one archive
+// loaded by the asynchronous loader.
+bool threaded(const string &dir, uint64_t count, unsigned threads)
+{
+	phases.Start("threads: roundtrip");
+	atomic<bool> ok(true);
+	vector<thread> workers;
+	for(unsigned t = 0; t < threads; t++)
+	{
+		workers.push_back(thread([&, t]() {
+			auto path = dir + "/iffstress-thread-" + to_string(t) + ".iff";
+			if(!roundtrip(path, count, t % 2)) ok = false;
+		}));
+	}
+	for(auto &w : workers) w.join();
+	phases.Stop(ok);
+
+	phases.Start("threads: async load");
+	auto iff = new IFF(dir + "/iffstress-thread-0.iff");
+	bool loaded = false;
+	{
+		AsyncLoader loader(iff, 256, threads);
+		auto all = loader.LoadAll(iff);
+		loader.Submit();
+		loaded = all.get();
+	}
+	loaded = phases.Stop(loaded && verify(iff, count));
+	delete iff;
+	return ok && loaded;
+}
+
+
+// A single chunk larger than 4 GB, taken from a sparse file with a few
+// marked spots, plain or compressed. Each is loaded whole.
+bool big(const string &dir, uint64_t size, uint64_t id)
+{
+	auto name = string(IsCompressedID(id) ? "big compressed" : "big plain");
+	auto src = dir + "/iffstress-big.src";
+	auto path = dir + "/iffstress-big.iff";
+	const char mark[] = "0123456789abcdef";
+	const uint64_t spots[] = { 0, size / 2 - 8, size - 16 };
+	int fd = open(src.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || ftruncate(fd, (off_t)size) != 0) return false;
+
+	for(auto at : spots) pwrite(fd, mark, 16, (off_t)at);
+	close(fd);
+
+	auto iff = new IFF(path, true);
+	phases.Start(name + ": save");
+	iff->AddChunk(id)->SetSource(src, 0, size);
+	bool ok = phases.Stop(iff->Save());
+
+	phases.Start(name + ": load");
+	ok &= iff->Reopen() && iff->NumChunks() == 1;
+	ok &= phases.Stop(ok && iff->LoadAllChunks());
+
+	phases.Start(name + ": verify");
+	auto c = ok ? iff->GetChunk(0) : nullptr;
+	ok &= c && c->GetSize() == size && c->GetData();
+	for(auto at : spots) ok = ok && memcmp(c->GetData() + at, mark, 16) == 0;
+	// Everything else is zero.
+	for(uint64_t at = 4096; ok && at < size; at += 1 << 20) ok = ok && c->GetData()[at] == 0;
+	phases.Stop(ok);
+	delete iff;
+	unlink(src.c_str());
+	return ok;
+}
+
+
+// Checks a chunk read by StreamReader against the marked spots of a sparse
+// source, without ever holding the whole chunk in memory.
+class SparseCheck : public StreamHandler
+{
+	const char			*mark;
+	vector<uint64_t>	spots;
+
+public:
+	uint64_t			chunks = 0;
+	uint64_t			seen = 0;
+	uint64_t			marked = 0;		// Non-zero bytes found
+	bool				ok = true;
+
+	SparseCheck(const char *m, const vector<uint64_t> &s) : mark(m), spots(s) {}
+
+	bool Data(uint64_t /*id*/, const char *data, uint64_t len, uint64_t offset) override
+	{
+		static const char zero[65536] = {};
+		ok &= offset == seen;
+		seen += len;
+		for(uint64_t at = 0; ok && at < len; at += sizeof(zero))
+		{
+			auto n = min(len - at, (uint64_t)sizeof(zero));
+			if(memcmp(data + at, zero, n) == 0) continue;
+
+			// Only the marked spots may hold anything.
+			for(uint64_t i = at; i < at + n; i++)
+			{
+				if(data[i] == 0) continue;
+
+				char want = 0;
+				for(auto s : spots)
+					if(offset + i >= s && offset + i < s + 16) want = mark[offset + i - s];
+				ok &= data[i] == want;
+				marked++;
+			}
+		}
+		return ok;
+	}
+
+	void EndChunk(uint64_t /*id*/, uint64_t /*size*/) override
+	{
+		chunks++;
+	}
+};
+
+
+// A single chunk larger than 4 GB, saved from a sparse file and checked
+// through StreamReader, so it runs without that much memory. One of the
+// marked spots straddles the 4 GB boundary.
+bool huge(const string &dir, uint64_t size, uint64_t id)
+{
+	auto name = string(IsCompressedID(id) ? "huge compressed" : "huge plain");
+	auto src = dir + "/iffstress-huge.src";
+	auto path = dir + "/iffstress-huge.iff";
+	const char mark[] = "0123456789abcdef";
+	const vector<uint64_t> spots = { 0, ((uint64_t)1 << 32) - 8, size - 16 };
+	int fd = open(src.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || ftruncate(fd, (off_t)size) != 0) return false;
+
+	for(auto at : spots) pwrite(fd, mark, 16, (off_t)at);
+	close(fd);
+
+	auto iff = new IFF(path, true);
+	phases.Start(name + ": save");
+	iff->AddChunk(id)->SetSource(src, 0, size);
+	bool ok = phases.Stop(iff->Save());
+	delete iff;
+	unlink(src.c_str());
+
+	phases.Start(name + ": stream");
+	SparseCheck check(mark, spots);
+	fd = open(path.c_str(), O_RDONLY);
+	if(ok && fd >= 0)
+	{
+		FileSource in(fd);
+		StreamReader reader(&in);
+		ok = reader.Run(&check);
+	}
+	if(fd >= 0) close(fd);
+	ok &= check.ok && check.chunks == 1 && check.seen == size && check.marked == spots.size() * 16;
+	return phases.Stop(ok);
+}
+
+
+int main(int argc, char * const *argv)
+{
+	static struct option longopts[] = {
+		{"help", no_argument, nullptr, 'h'},
+		{"dir", required_argument, nullptr, 'd'},
+		{"chunks", required_argument, nullptr, 'n'},
+		{"depth", required_argument, nullptr, 'D'},
+		{"threads", required_argument, nullptr, 't'},
+		{"big", required_argument, nullptr, 'b'},
+		{"huge", required_argument, nullptr, 'H'},
+		{"keep", no_argument, nullptr, 'k'},
+		{nullptr, 0, nullptr, 0}
+	};
+
+	string dir = ".";
+	uint64_t count = 1000000;
+	uint32_t depth = 4096;
+	unsigned threads = 4;
+	uint64_t bigsize = 0;
+	uint64_t hugesize = (uint64_t)4097 << 20;
+	bool keep = false;
+	int ch;
+	while((ch = getopt_long(argc, argv, "hd:n:D:t:b:H:k", longopts, NULL)) != -1)
+	{
+		switch(ch)
+		{
+			case 'h':
+				usage();
+				return 0;
+				break;
+			case 'd':
+				dir = optarg;
+				break;
+			case 'n':
+				count = strtoull(optarg, nullptr, 10);
+				break;
+			case 'D':
+				depth = (uint32_t)strtoul(optarg, nullptr, 10);
+				break;
+			case 't':
+				threads = (unsigned)strtoul(optarg, nullptr, 10);
+				break;
+			case 'b':
+				bigsize = strtoull(optarg, nullptr, 10) << 20;
+				break;
+			case 'H':
+				hugesize = strtoull(optarg, nullptr, 10) << 20;
+				break;
+			case 'k':
+				keep = true;
+				break;
+			case 0:
+				break;
+
+			default:
+				usage();
+				return 0;
+				break;
+		}
+	}
+	if(count == 0 || depth == 0 || threads == 0 || (bigsize && bigsize < 64) || (hugesize && hugesize <= (uint64_t)4096 << 20))
+	{
+		usage();
+		return 1;
+	}
+
+	bool ok = many(dir, count);
+	ok &= deep(dir, depth);
+	ok &= threaded(dir, count / 10 ? count / 10 : 1, threads);
+	if(hugesize)
+	{
+		ok &= huge(dir, hugesize, IFF_UTF8);
+		ok &= huge(dir, hugesize, IFF_COMP_UTF8);
+	}
+	if(bigsize)
+	{
+		ok &= big(dir, bigsize, IFF_UTF8);
+		ok &= big(dir, bigsize, IFF_COMP_UTF8);
+	}
+	phases.Print();
+
+	if(!keep)
+	{
+		unlink((dir + "/iffstress-many.iff").c_str());
+		unlink((dir + "/iffstress-deep.iff").c_str());
+		unlink((dir + "/iffstress-big.iff").c_str());
+		unlink((dir + "/iffstress-huge.iff").c_str());
+		for(unsigned t = 0; t < threads; t++) unlink((dir + "/iffstress-thread-" + to_string(t) + ".iff").c_str());
+	}
+
+	cout << (ok ? "Stress test passed.\n" : "Stress test FAILED.\n");
+	return ok ? 0 : 2;
+}
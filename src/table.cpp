@@ -0,0 +1,123 @@
+//
+//  table.cpp
+//  Flat chunk table for bulk queries.
+//
+//  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
+//
+
+#include "iff.h"
+
+namespace IFFSpace
+{
+	// The query loops below avoid branches and pointer chasing,
+	// reading the arrays front to back so the compiler can turn
+	// them into vector code.
+
+#pragma mark Building the table
+	// Append a chunk and return its index.
+	// Indices are stored as 32-bit parents, so this returns
+	// IFF_NO_PARENT instead once the table is full.
+	uint32_t ChunkTable::Add(uint64_t id, uint64_t offset, uint64_t size, uint32_t parent)
+	{
+		if(ids.size() >= IFF_NO_PARENT) return IFF_NO_PARENT;
+
+		ids.push_back(id);
+		offsets.push_back(offset);
+		sizes.push_back(size);
+		parents.push_back(parent);
+		return (uint32_t)(ids.size() - 1);
+	}
+
+
+	void ChunkTable::Clear()
+	{
+		ids.clear();
+		offsets.clear();
+		sizes.clear();
+		parents.clear();
+	}
+
+
+	size_t ChunkTable::NumChunks()
+	{
+		return ids.size();
+	}
+
+
+#pragma mark Queries
+	// Size of the whole file, including the 16-byte IFF header.
+	// Matches IFF::GetFileSize() for a freshly scanned file.
+	uint64_t ChunkTable::GetFileSize()
+	{
+		return SumChildren(IFF_NO_PARENT) + 16;
+	}
+
+
+	// Sum of the full sizes (with headers) of all direct children of parent.
+	// Pass IFF_NO_PARENT for the top-level chunks.
+	uint64_t ChunkTable::SumChildren(uint32_t parent)
+	{
+		const uint64_t *s = sizes.data();
+		const uint32_t *p = parents.data();
+		size_t n = sizes.size();
+		uint64_t total = 0;
+		for(size_t i = 0; i < n; i++)
+			total += (p[i] == parent) ? s[i] + 16 : 0;
+		return total;
+	}
+
+
+	// Sum of the data sizes of all chunks with the given identifier,
+	// at any depth.
+	uint64_t ChunkTable::SumSizes(uint64_t id)
+	{
+		const uint64_t *s = sizes.data();
+		const uint64_t *ip = ids.data();
+		size_t n = sizes.size();
+		uint64_t total = 0;
+		for(size_t i = 0; i < n; i++)
+			total += (ip[i] == id) ? s[i] : 0;
+		return total;
+	}
+
+
+	// Number of chunks with the given identifier, at any depth.
+	size_t ChunkTable::Count(uint64_t id)
+	{
+		const uint64_t *ip = ids.data();
+		size_t n = ids.size();
+		size_t count = 0;
+		for(size_t i = 0; i < n; i++)
+			count += (ip[i] == id);
+		return count;
+	}
+
+
+	// Indices of all chunks with the given identifier, in file order.
+	vector<size_t> ChunkTable::Find(uint64_t id)
+	{
+		vector<size_t> found;
+		found.reserve(Count(id));
+		const uint64_t *ip = ids.data();
+		size_t n = ids.size();
+		for(size_t i = 0; i < n; i++)
+		{
+			if(ip[i] == id) found.push_back(i);
+		}
+		return found;
+	}
+
+
+	// Nesting depth of a chunk. Top-level chunks are at depth 0.
+	uint32_t ChunkTable::GetDepth(size_t index)
+	{
+		uint32_t depth = 0;
+		uint32_t p = parents.at(index);
+		while(p != IFF_NO_PARENT)
+		{
+			depth++;
+			p = parents[p];
+		}
+		return depth;
+	}
+} // End namespace IFFSpace
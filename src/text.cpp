@@ -0,0 +1,731 @@
+//
+//  text.cpp
+//  Text validation and transcoding between the text chunk types.
+//
+//  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
+//
+
+#include <cstring>
+#include "iff.h"
+#include "text.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IFF_X86_KERNELS
+#endif
+
+namespace IFFSpace
+{
+#pragma mark Chunk types
+	bool IsTextID(uint64_t id)
+	{
+		return GetTextUnitSize(id) != 0;
+	}
+
+
+	bool IsCompressedID(uint64_t id)
+	{
+		switch(id)
+		{
+			case IFF_COMP_UTF8:
+			case IFF_COMP_UTF16:
+			case IFF_COMP_UTF32:
+			case IFF_COMP_BINARY:
+				return true;
+		}
+		return false;
+	}
+
+
+	// Return the uncompressed equivalent of a compressed type.
+	// Other types are returned unchanged.
+	uint64_t GetPlainID(uint64_t id)
+	{
+		switch(id)
+		{
+			case IFF_COMP_UTF8:
+				return IFF_UTF8;
+			case IFF_COMP_UTF16:
+				return IFF_UTF16;
+			case IFF_COMP_UTF32:
+				return IFF_UTF32;
+			case IFF_COMP_BINARY:
+				return IFF_BINARY;
+		}
+		return id;
+	}
+
+
+	// Return the compressed equivalent of a plain text type.
+	// Other types are returned unchanged.
+	uint64_t GetCompressedID(uint64_t id)
+	{
+		switch(id)
+		{
+			case IFF_UTF8:
+				return IFF_COMP_UTF8;
+			case IFF_UTF16:
+				return IFF_COMP_UTF16;
+			case IFF_UTF32:
+				return IFF_COMP_UTF32;
+			case IFF_BINARY:
+				return IFF_COMP_BINARY;
+		}
+		return id;
+	}
+
+
+	// Bytes per code unit, or 0 if the type isn't text.
+	unsigned GetTextUnitSize(uint64_t id)
+	{
+		switch(GetPlainID(id))
+		{
+			case IFF_ASCII:
+			case IFF_UTF8:
+				return 1;
+			case IFF_UTF16:
+				return 2;
+			case IFF_UTF32:
+				return 4;
+		}
+		return 0;
+	}
+
+
+#pragma mark ASCII kernels
+	// Each kernel handles the longest run of ASCII it can at the
+	// start of the input, and returns the number of code units done.
+	// Callers fall back to the scalar code for the rest.
+
+	static size_t AsciiPrefixScalar(const uint8_t *s, size_t n)
+	{
+		size_t i = 0;
+		for(; i + 8 <= n; i += 8)
+		{
+			uint64_t v;
+			memcpy(&v, s + i, 8);
+			if(v & 0x8080808080808080ULL) break;
+		}
+		while(i < n && s[i] < 0x80) i++;
+		return i;
+	}
+
+
+	static size_t AsciiWiden16Scalar(const uint8_t *s, char16_t *d, size_t n)
+	{
+		size_t i = 0;
+		while(i < n && s[i] < 0x80)
+		{
+			d[i] = s[i];
+			i++;
+		}
+		return i;
+	}
+
+
+	static size_t AsciiWiden32Scalar(const uint8_t *s, char32_t *d, size_t n)
+	{
+		size_t i = 0;
+		while(i < n && s[i] < 0x80)
+		{
+			d[i] = s[i];
+			i++;
+		}
+		return i;
+	}
+
+
+#ifdef IFF_X86_KERNELS
+	__attribute__((target("sse2")))
+	static size_t AsciiPrefixSSE2(const uint8_t *s, size_t n)
+	{
+		size_t i = 0;
+		for(; i + 16 <= n; i += 16)
+		{
+			auto v = _mm_loadu_si128((const __m128i *)(s + i));
+			int m = _mm_movemask_epi8(v);
+			if(m) return i + (size_t)__builtin_ctz((unsigned)m);
+		}
+		return i + AsciiPrefixScalar(s + i, n - i);
+	}
+
+
+	__attribute__((target("avx2")))
+	static size_t AsciiPrefixAVX2(const uint8_t *s, size_t n)
+	{
+		size_t i = 0;
+		for(; i + 32 <= n; i += 32)
+		{
+			auto v = _mm256_loadu_si256((const __m256i *)(s + i));
+			int m = _mm256_movemask_epi8(v);
+			if(m) return i + (size_t)__builtin_ctz((unsigned)m);
+		}
+		return i + AsciiPrefixSSE2(s + i, n - i);
+	}
+
+
+	__attribute__((target("sse2")))
+	static size_t AsciiWiden16SSE2(const uint8_t *s, char16_t *d, size_t n)
+	{
+		size_t i = 0;
+		auto zero = _mm_setzero_si128();
+		for(; i + 16 <= n; i += 16)
+		{
+			auto v = _mm_loadu_si128((const __m128i *)(s + i));
+			if(_mm_movemask_epi8(v)) break;
+			_mm_storeu_si128((__m128i *)(d + i), _mm_unpacklo_epi8(v, zero));
+			_mm_storeu_si128((__m128i *)(d + i + 8), _mm_unpackhi_epi8(v, zero));
+		}
+		return i + AsciiWiden16Scalar(s + i, d + i, n - i);
+	}
+
+
+	__attribute__((target("avx2")))
+	static size_t AsciiWiden16AVX2(const uint8_t *s, char16_t *d, size_t n)
+	{
+		size_t i = 0;
+		for(; i + 16 <= n; i += 16)
+		{
+			auto v = _mm_loadu_si128((const __m128i *)(s + i));
+			if(_mm_movemask_epi8(v)) break;
+			_mm256_storeu_si256((__m256i *)(d + i), _mm256_cvtepu8_epi16(v));
+		}
+		return i + AsciiWiden16Scalar(s + i, d + i, n - i);
+	}
+
+
+	__attribute__((target("sse2")))
+	static size_t AsciiWiden32SSE2(const uint8_t *s, char32_t *d, size_t n)
+	{
+		size_t i = 0;
+		auto zero = _mm_setzero_si128();
+		for(; i + 16 <= n; i += 16)
+		{
+			auto v = _mm_loadu_si128((const __m128i *)(s + i));
+			if(_mm_movemask_epi8(v)) break;
+			auto lo = _mm_unpacklo_epi8(v, zero);
+			auto hi = _mm_unpackhi_epi8(v, zero);
+			_mm_storeu_si128((__m128i *)(d + i), _mm_unpacklo_epi16(lo, zero));
+			_mm_storeu_si128((__m128i *)(d + i + 4), _mm_unpackhi_epi16(lo, zero));
+			_mm_storeu_si128((__m128i *)(d + i + 8), _mm_unpacklo_epi16(hi, zero));
+			_mm_storeu_si128((__m128i *)(d + i + 12), _mm_unpackhi_epi16(hi, zero));
+		}
+		return i + AsciiWiden32Scalar(s + i, d + i, n - i);
+	}
+
+
+	__attribute__((target("avx2")))
+	static size_t AsciiWiden32AVX2(const uint8_t *s, char32_t *d, size_t n)
+	{
+		size_t i = 0;
+		for(; i + 16 <= n; i += 16)
+		{
+			auto v = _mm_loadu_si128((const __m128i *)(s + i));
+			if(_mm_movemask_epi8(v)) break;
+			_mm256_storeu_si256((__m256i *)(d + i), _mm256_cvtepu8_epi32(v));
+			_mm256_storeu_si256((__m256i *)(d + i + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+		}
+		return i + AsciiWiden32Scalar(s + i, d + i, n - i);
+	}
+
+
+	// Narrowing: 16 code units at a time, all of which must be below 0x80.
+	__attribute__((target("sse2")))
+	static size_t AsciiNarrow16SSE2(const char16_t *s, uint8_t *d, size_t n)
+	{
+		size_t i = 0;
+		auto mask = _mm_set1_epi16((short)0xff80);
+		auto zero = _mm_setzero_si128();
+		for(; i + 16 <= n; i += 16)
+		{
+			auto a = _mm_loadu_si128((const __m128i *)(s + i));
+			auto b = _mm_loadu_si128((const __m128i *)(s + i + 8));
+			auto hi = _mm_and_si128(_mm_or_si128(a, b), mask);
+			if(_mm_movemask_epi8(_mm_cmpeq_epi16(hi, zero)) != 0xffff) break;
+			_mm_storeu_si128((__m128i *)(d + i), _mm_packus_epi16(a, b));
+		}
+		while(i < n && s[i] < 0x80)
+		{
+			d[i] = (uint8_t)s[i];
+			i++;
+		}
+		return i;
+	}
+
+
+	__attribute__((target("sse2")))
+	static size_t AsciiNarrow32SSE2(const char32_t *s, uint8_t *d, size_t n)
+	{
+		size_t i = 0;
+		auto mask = _mm_set1_epi32((int)0xffffff80);
+		auto zero = _mm_setzero_si128();
+		for(; i + 16 <= n; i += 16)
+		{
+			auto a = _mm_loadu_si128((const __m128i *)(s + i));
+			auto b = _mm_loadu_si128((const __m128i *)(s + i + 4));
+			auto c = _mm_loadu_si128((const __m128i *)(s + i + 8));
+			auto e = _mm_loadu_si128((const __m128i *)(s + i + 12));
+			auto hi = _mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, e)), mask);
+			if(_mm_movemask_epi8(_mm_cmpeq_epi32(hi, zero)) != 0xffff) break;
+			auto lo16 = _mm_packs_epi32(a, b);
+			auto hi16 = _mm_packs_epi32(c, e);
+			_mm_storeu_si128((__m128i *)(d + i), _mm_packus_epi16(lo16, hi16));
+		}
+		while(i < n && s[i] < 0x80)
+		{
+			d[i] = (uint8_t)s[i];
+			i++;
+		}
+		return i;
+	}
+#endif
+
+
+	static size_t AsciiNarrow16Scalar(const char16_t *s, uint8_t *d, size_t n)
+	{
+		size_t i = 0;
+		while(i < n && s[i] < 0x80)
+		{
+			d[i] = (uint8_t)s[i];
+			i++;
+		}
+		return i;
+	}
+
+
+	static size_t AsciiNarrow32Scalar(const char32_t *s, uint8_t *d, size_t n)
+	{
+		size_t i = 0;
+		while(i < n && s[i] < 0x80)
+		{
+			d[i] = (uint8_t)s[i];
+			i++;
+		}
+		return i;
+	}
+
+
+	// Kernels picked once for the running CPU.
+	struct TextKernels
+	{
+		size_t (*prefix)(const uint8_t *, size_t);
+		size_t (*widen16)(const uint8_t *, char16_t *, size_t);
+		size_t (*widen32)(const uint8_t *, char32_t *, size_t);
+		size_t (*narrow16)(const char16_t *, uint8_t *, size_t);
+		size_t (*narrow32)(const char32_t *, uint8_t *, size_t);
+	};
+
+
+	static TextKernels SelectKernels()
+	{
+		TextKernels k = {AsciiPrefixScalar, AsciiWiden16Scalar, AsciiWiden32Scalar,
+			AsciiNarrow16Scalar, AsciiNarrow32Scalar};
+#ifdef IFF_X86_KERNELS
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("sse2"))
+		{
+			k = {AsciiPrefixSSE2, AsciiWiden16SSE2, AsciiWiden32SSE2,
+				AsciiNarrow16SSE2, AsciiNarrow32SSE2};
+		}
+		if(__builtin_cpu_supports("avx2"))
+		{
+			k.prefix = AsciiPrefixAVX2;
+			k.widen16 = AsciiWiden16AVX2;
+			k.widen32 = AsciiWiden32AVX2;
+		}
+#endif
+		return k;
+	}
+
+
+	static const TextKernels kernels = SelectKernels();
+
+
+#pragma mark Scalar decoding and encoding
+	// Decode one UTF-8 sequence at s, rejecting overlong forms,
+	// surrogates and values above U+10FFFF.
+	// Returns the number of bytes used, or 0 if invalid.
+	static inline size_t DecodeUTF8(const uint8_t *s, size_t n, char32_t *cp)
+	{
+		uint8_t c = s[0];
+		if(c < 0x80)
+		{
+			*cp = c;
+			return 1;
+		}
+		uint8_t lo = 0x80, hi = 0xbf;
+		size_t len;
+		char32_t v;
+		if(c >= 0xc2 && c <= 0xdf)
+		{
+			len = 2;
+			v = c & 0x1f;
+		} else if(c >= 0xe0 && c <= 0xef) {
+			len = 3;
+			v = c & 0x0f;
+			if(c == 0xe0) lo = 0xa0;
+			if(c == 0xed) hi = 0x9f;
+		} else if(c >= 0xf0 && c <= 0xf4) {
+			len = 4;
+			v = c & 0x07;
+			if(c == 0xf0) lo = 0x90;
+			if(c == 0xf4) hi = 0x8f;
+		} else {
+			return 0;
+		}
+		if(n < len) return 0;
+		// Only the first continuation byte has a restricted range.
+		if(s[1] < lo || s[1] > hi) return 0;
+		v = (v << 6) | (s[1] & 0x3f);
+		for(size_t i = 2; i < len; i++)
+		{
+			if((s[i] & 0xc0) != 0x80) return 0;
+			v = (v << 6) | (s[i] & 0x3f);
+		}
+		*cp = v;
+		return len;
+	}
+
+
+	static inline size_t EncodeUTF8(char32_t cp, uint8_t *d)
+	{
+		if(cp < 0x80)
+		{
+			d[0] = (uint8_t)cp;
+			return 1;
+		}
+		if(cp < 0x800)
+		{
+			d[0] = (uint8_t)(0xc0 | (cp >> 6));
+			d[1] = (uint8_t)(0x80 | (cp & 0x3f));
+			return 2;
+		}
+		if(cp < 0x10000)
+		{
+			d[0] = (uint8_t)(0xe0 | (cp >> 12));
+			d[1] = (uint8_t)(0x80 | ((cp >> 6) & 0x3f));
+			d[2] = (uint8_t)(0x80 | (cp & 0x3f));
+			return 3;
+		}
+		d[0] = (uint8_t)(0xf0 | (cp >> 18));
+		d[1] = (uint8_t)(0x80 | ((cp >> 12) & 0x3f));
+		d[2] = (uint8_t)(0x80 | ((cp >> 6) & 0x3f));
+		d[3] = (uint8_t)(0x80 | (cp & 0x3f));
+		return 4;
+	}
+
+
+	// Decode one UTF-16 code point. Returns units used, or 0 if invalid.
+	static inline size_t DecodeUTF16(const char16_t *s, size_t n, char32_t *cp)
+	{
+		char16_t c = s[0];
+		if((c & 0xf800) != 0xd800)
+		{
+			*cp = c;
+			return 1;
+		}
+		if(c > 0xdbff || n < 2 || (s[1] & 0xfc00) != 0xdc00) return 0;
+		*cp = 0x10000 + (((char32_t)(c & 0x3ff) << 10) | (s[1] & 0x3ff));
+		return 2;
+	}
+
+
+	static inline size_t EncodeUTF16(char32_t cp, char16_t *d)
+	{
+		if(cp < 0x10000)
+		{
+			d[0] = (char16_t)cp;
+			return 1;
+		}
+		cp -= 0x10000;
+		d[0] = (char16_t)(0xd800 | (cp >> 10));
+		d[1] = (char16_t)(0xdc00 | (cp & 0x3ff));
+		return 2;
+	}
+
+
+	static inline bool ValidCodePoint(char32_t cp)
+	{
+		return cp < 0x110000 && (cp & 0xfffff800) != 0xd800;
+	}
+
+
+#pragma mark Validation
+	bool ValidateASCII(const char *s, uint64_t len)
+	{
+		return kernels.prefix((const uint8_t *)s, len) == len;
+	}
+
+
+	bool ValidateUTF8(const char *s, uint64_t len)
+	{
+		auto u = (const uint8_t *)s;
+		size_t i = 0;
+		while(i < len)
+		{
+			if(u[i] < 0x80)
+			{
+				i += kernels.prefix(u + i, len - i);
+				continue;
+			}
+			char32_t cp;
+			size_t used = DecodeUTF8(u + i, len - i, &cp);
+			if(used == 0) return false;
+			i += used;
+		}
+		return true;
+	}
+
+
+	bool ValidateUTF16(const char16_t *s, uint64_t count)
+	{
+		size_t i = 0;
+		while(i < count)
+		{
+			// Surrogate-free runs need no pairing checks.
+			if((s[i] & 0xf800) != 0xd800)
+			{
+				i++;
+				continue;
+			}
+			char32_t cp;
+			size_t used = DecodeUTF16(s + i, count - i, &cp);
+			if(used == 0) return false;
+			i += used;
+		}
+		return true;
+	}
+
+
+	// Branch-free so that the compiler can vectorise it.
+	bool ValidateUTF32(const char32_t *s, uint64_t count)
+	{
+		uint32_t bad = 0;
+		for(size_t i = 0; i < count; i++)
+		{
+			uint32_t c = s[i];
+			bad |= (c > 0x10ffff) | ((c & 0xfffff800) == 0xd800);
+		}
+		return bad == 0;
+	}
+
+
+	// Validate size bytes of a text chunk's (decompressed) data.
+	bool ValidateText(uint64_t id, const char *data, uint64_t size)
+	{
+		auto unit = GetTextUnitSize(id);
+		if(unit == 0 || size % unit) return false;
+
+		switch(GetPlainID(id))
+		{
+			case IFF_ASCII:
+				return ValidateASCII(data, size);
+			case IFF_UTF8:
+				return ValidateUTF8(data, size);
+			case IFF_UTF16:
+				return ValidateUTF16((const char16_t *)data, size / 2);
+			case IFF_UTF32:
+				return ValidateUTF32((const char32_t *)data, size / 4);
+		}
+		return false;
+	}
+
+
+#pragma mark Transcoding
+	// Most output units count input units can turn into. A UTF-8 byte
+	// never gives more than one UTF-16 or UTF-32 unit, a UTF-16 unit at
+	// most three UTF-8 bytes, and a UTF-32 unit four bytes or two units.
+	static uint64_t MaxUnits(uint64_t count, unsigned inunit, unsigned outunit)
+	{
+		if(inunit == 2 && outunit == 1) return count * 3;
+		if(inunit == 4) return count * (4 / outunit);
+		return count;
+	}
+
+
+	// Each converter writes into a buffer sized by MaxUnits()
+	// and returns the number of units written, or -1 on invalid input.
+
+	static int64_t UTF8To16(const uint8_t *s, size_t n, char16_t *d)
+	{
+		size_t i = 0, o = 0;
+		while(i < n)
+		{
+			if(s[i] < 0x80)
+			{
+				size_t done = kernels.widen16(s + i, d + o, n - i);
+				i += done;
+				o += done;
+				continue;
+			}
+			char32_t cp;
+			size_t used = DecodeUTF8(s + i, n - i, &cp);
+			if(used == 0) return -1;
+			i += used;
+			o += EncodeUTF16(cp, d + o);
+		}
+		return (int64_t)o;
+	}
+
+
+	static int64_t UTF8To32(const uint8_t *s, size_t n, char32_t *d)
+	{
+		size_t i = 0, o = 0;
+		while(i < n)
+		{
+			if(s[i] < 0x80)
+			{
+				size_t done = kernels.widen32(s + i, d + o, n - i);
+				i += done;
+				o += done;
+				continue;
+			}
+			char32_t cp;
+			size_t used = DecodeUTF8(s + i, n - i, &cp);
+			if(used == 0) return -1;
+			i += used;
+			d[o++] = cp;
+		}
+		return (int64_t)o;
+	}
+
+
+	static int64_t UTF16To8(const char16_t *s, size_t n, uint8_t *d)
+	{
+		size_t i = 0, o = 0;
+		while(i < n)
+		{
+			if(s[i] < 0x80)
+			{
+				size_t done = kernels.narrow16(s + i, d + o, n - i);
+				i += done;
+				o += done;
+				continue;
+			}
+			char32_t cp;
+			size_t used = DecodeUTF16(s + i, n - i, &cp);
+			if(used == 0) return -1;
+			i += used;
+			o += EncodeUTF8(cp, d + o);
+		}
+		return (int64_t)o;
+	}
+
+
+	static int64_t UTF32To8(const char32_t *s, size_t n, uint8_t *d)
+	{
+		size_t i = 0, o = 0;
+		while(i < n)
+		{
+			if(s[i] < 0x80)
+			{
+				size_t done = kernels.narrow32(s + i, d + o, n - i);
+				i += done;
+				o += done;
+				continue;
+			}
+			if(!ValidCodePoint(s[i])) return -1;
+			o += EncodeUTF8(s[i++], d + o);
+		}
+		return (int64_t)o;
+	}
+
+
+	static int64_t UTF16To32(const char16_t *s, size_t n, char32_t *d)
+	{
+		size_t i = 0, o = 0;
+		while(i < n)
+		{
+			char32_t cp;
+			size_t used = DecodeUTF16(s + i, n - i, &cp);
+			if(used == 0) return -1;
+			i += used;
+			d[o++] = cp;
+		}
+		return (int64_t)o;
+	}
+
+
+	static int64_t UTF32To16(const char32_t *s, size_t n, char16_t *d)
+	{
+		size_t o = 0;
+		for(size_t i = 0; i < n; i++)
+		{
+			if(!ValidCodePoint(s[i])) return -1;
+			o += EncodeUTF16(s[i], d + o);
+		}
+		return (int64_t)o;
+	}
+
+
+	bool TranscodeText(uint64_t from, const char *src, uint64_t size, uint64_t to, char **dst, uint64_t *dstsize)
+	{
+		auto inunit = GetTextUnitSize(from);
+		auto outunit = GetTextUnitSize(to);
+		if(inunit == 0 || outunit == 0 || size % inunit) return false;
+
+		from = GetPlainID(from);
+		to = GetPlainID(to);
+		uint64_t count = size / inunit;
+
+		// Same encoding, or ASCII into UTF-8: validate and copy.
+		if(from == to || (from == IFF_ASCII && to == IFF_UTF8) || (from == IFF_UTF8 && to == IFF_ASCII))
+		{
+			if(!ValidateText(to == IFF_ASCII ? to : from, src, size)) return false;
+			*dst = new char[size];
+			memcpy(*dst, src, size);
+			*dstsize = size;
+			return true;
+		}
+
+		if(from == IFF_ASCII && !ValidateASCII(src, size)) return false;
+
+		// Convert once into a worst-case buffer.
+		auto room = MaxUnits(count, inunit, outunit) * outunit;
+		auto buf = new char[room + 1];
+		int64_t units = -1;
+		auto s8 = (const uint8_t *)src;
+		auto s16 = (const char16_t *)src;
+		auto s32 = (const char32_t *)src;
+		switch(inunit * 8 + outunit)
+		{
+			case 1 * 8 + 2:
+				units = UTF8To16(s8, count, (char16_t *)buf);
+				break;
+			case 1 * 8 + 4:
+				units = UTF8To32(s8, count, (char32_t *)buf);
+				break;
+			case 2 * 8 + 1:
+				units = UTF16To8(s16, count, (uint8_t *)buf);
+				break;
+			case 2 * 8 + 4:
+				units = UTF16To32(s16, count, (char32_t *)buf);
+				break;
+			case 4 * 8 + 1:
+				units = UTF32To8(s32, count, (uint8_t *)buf);
+				break;
+			case 4 * 8 + 2:
+				units = UTF32To16(s32, count, (char16_t *)buf);
+				break;
+		}
+		// Narrowing into ASCII only works if everything was ASCII.
+		if(units >= 0 && to == IFF_ASCII && !ValidateASCII(buf, (uint64_t)units)) units = -1;
+		if(units < 0)
+		{
+			delete[] buf;
+			return false;
+		}
+
+		// Shrink the buffer if much of it went unused.
+		*dstsize = (uint64_t)units * outunit;
+		if(*dstsize < room - room / 4)
+		{
+			auto fit = new char[*dstsize + 1];
+			memcpy(fit, buf, *dstsize);
+			delete[] buf;
+			buf = fit;
+		}
+		*dst = buf;
+		return true;
+	}
+} // End namespace IFFSpace
@@ -0,0 +1,278 @@
+//
+//  writer.cpp
+//  Preallocated, sequential file writing.
+//
+//  Copyright (c) 2012-2020 Ronny Bangsund. All rights reserved.
+//
+
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "writer.h"
+
+namespace IFFSpace
+{
+#pragma mark SequentialWriter constructor
+	// Create or truncate the file at path and reserve total bytes for it.
+	SequentialWriter::SequentialWriter(string path, uint64_t total, bool odirect)
+	{
+		fill = 0;
+		offset = 0;
+		buf = nullptr;
+		direct = false;
+		ok = false;
+		int flags = O_WRONLY | O_CREAT | O_TRUNC;
+		fd = -1;
+#ifdef O_DIRECT
+		if(odirect)
+		{
+			fd = open(path.c_str(), flags | O_DIRECT, 0644);
+			direct = fd >= 0;
+		}
+#endif
+		// Not all filesystems support O_DIRECT; fall back to buffered writes.
+		if(fd < 0) fd = open(path.c_str(), flags, 0644);
+		if(fd < 0) return;
+
+		if(posix_memalign((void **)&buf, IFF_WRITER_ALIGN, IFF_WRITER_BUFSIZE) != 0)
+		{
+			buf = nullptr;
+			return;
+		}
+
+		// Preallocation is only a hint to keep the file contiguous.
+		// Unlike posix_fallocate(), this never falls back to writing
+		// every block, which would double the I/O of the save. Where the
+		// filesystem can't preallocate, it's skipped; running out of
+		// space fails the save before anything is written.
+#ifdef __linux__
+		if(total && fallocate(fd, 0, 0, (off_t)total) != 0 && errno == ENOSPC) return;
+#endif
+		ok = true;
+	}
+
+
+#pragma mark SequentialWriter destructor
+	SequentialWriter::~SequentialWriter()
+	{
+		if(fd >= 0) close(fd);
+		free(buf);
+	}
+
+
+	bool SequentialWriter::OK()
+	{
+		return ok;
+	}
+
+
+	bool SequentialWriter::IsDirect()
+	{
+		return direct;
+	}
+
+
+	int SequentialWriter::GetFD()
+	{
+		return fd;
+	}
+
+
+	// Current position in the file, including buffered data.
+	uint64_t SequentialWriter::Tell()
+	{
+		return offset + fill;
+	}
+
+
+#pragma mark Writing
+	// Write out the buffer. Until the final flush the buffer is always
+	// full, so every write is a whole number of aligned blocks. The final
+	// flush writes the aligned part directly, then drops O_DIRECT for the tail.
+	bool SequentialWriter::Flush(bool final)
+	{
+		if(!ok) return false;
+
+		uint64_t done = 0;
+		while(done < fill)
+		{
+			uint64_t len = fill - done;
+			if(direct && final)
+			{
+				uint64_t aligned = len & ~(uint64_t)(IFF_WRITER_ALIGN - 1);
+				if(aligned)
+				{
+					len = aligned;
+				} else {
+					int fl = fcntl(fd, F_GETFL);
+#ifdef O_DIRECT
+					fcntl(fd, F_SETFL, fl & ~O_DIRECT);
+#endif
+					direct = false;
+				}
+			}
+			auto n = pwrite(fd, buf + done, (size_t)len, (off_t)(offset + done));
+			if(n < 0 && errno == EINTR) continue;
+			if(n <= 0)
+			{
+				ok = false;
+				return false;
+			}
+
+			done += (uint64_t)n;
+		}
+		offset += fill;
+		fill = 0;
+		return true;
+	}
+
+
+	bool SequentialWriter::Write(const void *d, uint64_t len)
+	{
+		auto src = (const char *)d;
+		while(ok && len)
+		{
+			auto n = min(len, (uint64_t)IFF_WRITER_BUFSIZE - fill);
+			memcpy(buf + fill, src, n);
+			fill += n;
+			src += n;
+			len -= n;
+			if(fill == IFF_WRITER_BUFSIZE) Flush(false);
+		}
+		return ok;
+	}
+
+
+	// Copy a byte range of another file, reading straight into the buffer.
+	bool SequentialWriter::Copy(const string &file, uint64_t from, uint64_t len)
+	{
+		int in = open(file.c_str(), O_RDONLY);
+		if(in < 0) return false;
+
+		bool copied = Copy(in, from, len);
+		close(in);
+		return copied;
+	}
+
+
+	bool SequentialWriter::Copy(int in, uint64_t from, uint64_t len)
+	{
+		while(ok && len)
+		{
+			auto want = min(len, (uint64_t)IFF_WRITER_BUFSIZE - fill);
+			auto n = pread(in, buf + fill, (size_t)want, (off_t)from);
+			if(n < 0 && errno == EINTR) continue;
+			if(n <= 0) return false;
+
+			fill += (uint64_t)n;
+			from += (uint64_t)n;
+			len -= (uint64_t)n;
+			if(fill == IFF_WRITER_BUFSIZE) Flush(false);
+		}
+		return ok;
+	}
+
+
+	// Write whatever is left. The file can be synced through GetFD() afterwards.
+	bool SequentialWriter::Finish()
+	{
+		return Flush(true);
+	}
+
+
+#pragma mark PackedMap
+	// The scratch file is only made once something needs to spill.
+	PackedMap::PackedMap(string target)
+	{
+		near = target;
+		scratch = -1;
+		end = 0;
+		held = 0;
+	}
+
+
+	PackedMap::~PackedMap()
+	{
+		if(scratch >= 0) close(scratch);
+	}
+
+
+	PackedChunk *PackedMap::Add(Chunk *c)
+	{
+		return &chunks[c];
+	}
+
+
+	PackedChunk *PackedMap::Find(Chunk *c)
+	{
+		auto it = chunks.find(c);
+		return it != chunks.end() ? &it->second : nullptr;
+	}
+
+
+	// Add compressed data to the end of a chunk. Once a chunk no longer
+	// fits in memory, all of it moves to the scratch file. Chunks are
+	// packed one at a time, so each one is contiguous there.
+	bool PackedMap::Append(PackedChunk *p, const void *d, uint64_t len)
+	{
+		if(!p->spilled && held + len > IFF_PACKED_MAXMEM)
+		{
+			p->spilled = true;
+			p->offset = end;
+			held -= p->data.size();
+			bool moved = Spill(p->data.data(), p->data.size());
+			string().swap(p->data);
+			if(!moved) return false;
+		}
+
+		p->stored += len;
+		if(p->spilled) return Spill((const char *)d, len);
+
+		p->data.append((const char *)d, len);
+		held += len;
+		return true;
+	}
+
+
+	// Write a chunk's compressed data, and let go of it.
+	bool PackedMap::Write(SequentialWriter *w, PackedChunk *p)
+	{
+		if(p->spilled) return w->Copy(scratch, p->offset, p->stored);
+
+		bool written = w->Write(p->data.data(), p->data.size());
+		held -= p->data.size();
+		string().swap(p->data);
+		return written;
+	}
+
+
+	// Add to the end of the scratch file, creating it first if needed.
+	// It is unlinked right away, so it goes when it's closed.
+	bool PackedMap::Spill(const char *d, uint64_t len)
+	{
+		if(scratch < 0)
+		{
+			string pattern = near + ".XXXXXX";
+			vector<char> name(pattern.begin(), pattern.end());
+			name.push_back(0);
+			scratch = mkstemp(name.data());
+			if(scratch < 0) return false;
+
+			unlink(name.data());
+		}
+
+		while(len)
+		{
+			auto n = pwrite(scratch, d, (size_t)len, (off_t)end);
+			if(n < 0 && errno == EINTR) continue;
+			if(n <= 0) return false;
+
+			d += n;
+			end += (uint64_t)n;
+			len -= (uint64_t)n;
+		}
+		return true;
+	}
+} // End namespace IFFSpace